@@ -0,0 +1,878 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <new>
+
+// Count heap traffic and copies going through Str
+static std::atomic<size_t> g_alloc_count = 0;
+static std::atomic<size_t> g_alloc_bytes = 0;
+static std::atomic<size_t> g_copy_bytes = 0;
+static void* bench_malloc(size_t sz) { g_alloc_count.fetch_add(1, std::memory_order_relaxed); g_alloc_bytes.fetch_add(sz, std::memory_order_relaxed); return malloc(sz); }
+[[gnu::noinline]] static void bench_free(void* ptr) { free(ptr); }
+static void* bench_memcpy(void* dst, const void* src, size_t sz) { g_copy_bytes.fetch_add(sz, std::memory_order_relaxed); return memcpy(dst, src, sz); }
+#define STR_MEMALLOC bench_malloc
+#define STR_MEMFREE  bench_free
+#define STR_MEMCPY   bench_memcpy
+
+// Count heap traffic of std::string (and of everything else using new)
+void* operator new(size_t sz) { if (void* p = bench_malloc(sz ? sz : 1)) return p; throw std::bad_alloc(); }
+void  operator delete(void* p) noexcept { bench_free(p); }
+void  operator delete(void* p, size_t) noexcept { bench_free(p); }
+
+#include "str.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+struct BenchResult
+{
+    double  ns_per_op;
+    double  allocs_per_op;
+    double  alloc_bytes_per_op;
+    double  copy_bytes_per_op;      // < 0 when copies can't be counted (std::string)
+};
+
+enum BenchFormat
+{
+    BenchFormat_Text,
+    BenchFormat_Json,
+    BenchFormat_Csv,
+};
+
+static BenchFormat  g_format = BenchFormat_Text;
+static const char*  g_filter = NULL;
+static int          g_result_count = 0;
+
+static bool bench_enabled(const char* name)
+{
+    return g_filter == NULL || strstr(name, g_filter) != NULL;
+}
+
+template<typename FUNC>
+static BenchResult bench_run(int iterations, int ops_per_iteration, FUNC&& func)
+{
+    g_alloc_count = 0;
+    g_alloc_bytes = 0;
+    g_copy_bytes = 0;
+    auto t0 = bench_clock::now();
+    for (int i = 0; i < iterations; i++)
+        func();
+    auto t1 = bench_clock::now();
+    double ops = (double)iterations * ops_per_iteration;
+    BenchResult r;
+    r.ns_per_op = std::chrono::duration<double, std::nano>(t1 - t0).count() / ops;
+    r.allocs_per_op = g_alloc_count / ops;
+    r.alloc_bytes_per_op = g_alloc_bytes / ops;
+    r.copy_bytes_per_op = g_copy_bytes / ops;
+    return r;
+}
+
+// Run once to estimate the cost, then enough iterations to last about 'target_ms'
+template<typename FUNC>
+static BenchResult bench_run_timed(double target_ms, int ops_per_iteration, FUNC&& func)
+{
+    auto t0 = bench_clock::now();
+    func();
+    double once_ms = std::chrono::duration<double, std::milli>(bench_clock::now() - t0).count();
+    double iterations = once_ms > 0.0 ? target_ms / once_ms : 1e6;
+    return bench_run(iterations < 1.0 ? 1 : iterations > 1e6 ? 1000000 : (int)iterations, ops_per_iteration, func);
+}
+
+static void bench_begin()
+{
+    if (g_format == BenchFormat_Json)
+        printf("[\n");
+    else if (g_format == BenchFormat_Csv)
+        printf("name,ns_per_op,allocs_per_op,alloc_bytes_per_op,copy_bytes_per_op\n");
+}
+
+static void bench_end()
+{
+    if (g_format == BenchFormat_Json)
+        printf("\n]\n");
+}
+
+static void bench_print(const char* name, const BenchResult& r)
+{
+    switch (g_format)
+    {
+    case BenchFormat_Text:
+        if (r.copy_bytes_per_op >= 0.0)
+            printf("%-40s %10.2f ns/op %10.4f allocs/op %12.2f bytes/op %12.2f copied/op\n", name, r.ns_per_op, r.allocs_per_op, r.alloc_bytes_per_op, r.copy_bytes_per_op);
+        else
+            printf("%-40s %10.2f ns/op %10.4f allocs/op %12.2f bytes/op %12s copied/op\n", name, r.ns_per_op, r.allocs_per_op, r.alloc_bytes_per_op, "-");
+        break;
+    case BenchFormat_Json:
+        printf("%s  { \"name\": \"%s\", \"ns_per_op\": %.3f, \"allocs_per_op\": %.4f, \"alloc_bytes_per_op\": %.2f, \"copy_bytes_per_op\": ",
+            g_result_count ? ",\n" : "", name, r.ns_per_op, r.allocs_per_op, r.alloc_bytes_per_op);
+        if (r.copy_bytes_per_op >= 0.0)
+            printf("%.2f }", r.copy_bytes_per_op);
+        else
+            printf("null }");
+        break;
+    case BenchFormat_Csv:
+        printf("%s,%.3f,%.4f,%.2f,", name, r.ns_per_op, r.allocs_per_op, r.alloc_bytes_per_op);
+        if (r.copy_bytes_per_op >= 0.0)
+            printf("%.2f", r.copy_bytes_per_op);
+        printf("\n");
+        break;
+    }
+    g_result_count++;
+}
+
+//-------------------------------------------------------------------------
+// Operations x lengths x types
+//-------------------------------------------------------------------------
+
+// Source strings for one length range. Two copies of the data so that compare() can't take a pointer shortcut.
+struct BenchSource
+{
+    static const int COUNT = 64;
+    const char*         Name;
+    std::string         Data[2];
+    std::string_view    Views[2][COUNT];
+
+    BenchSource(const char* name, int min_len, int max_len)
+    {
+        Name = name;
+        for (int copy = 0; copy < 2; copy++)
+        {
+            Data[copy].resize(max_len);
+            for (int i = 0; i < max_len; i++)
+                Data[copy][i] = 'a' + i % 26;
+        }
+        for (int i = 0; i < COUNT; i++)
+        {
+            int len = min_len + (min_len == max_len ? 0 : (i * 37) % (max_len - min_len + 1));
+            Views[0][i] = std::string_view(Data[0].data(), len);
+            Views[1][i] = std::string_view(Data[1].data(), len);
+        }
+    }
+};
+
+template<typename S> static constexpr bool bench_is_std = std::is_same_v<S, std::string>;
+
+template<typename S>
+static void bench_setf(S& s, std::string_view v)
+{
+    if constexpr (bench_is_std<S>)
+    {
+        s.clear();
+        fmt::format_to(std::back_inserter(s), "{}", v);
+    }
+    else
+    {
+        s.setf("{}", v);
+    }
+}
+
+template<typename S>
+static void bench_appendf(S& s, std::string_view v)
+{
+    if constexpr (bench_is_std<S>)
+        fmt::format_to(std::back_inserter(s), "{}", v);
+    else
+        s.appendf("{}", v);
+}
+
+template<typename S>
+static void bench_ops_print(const char* name, BenchResult r)
+{
+    if constexpr (bench_is_std<S>)
+        r.copy_bytes_per_op = -1.0; // Copies inside std::string aren't visible to us
+    bench_print(name, r);
+}
+
+// Each op handles one source string:
+// - set, setf, set_ref: assign into a string reused across ops
+// - append, appendf: build the string in a fresh object, 16 bytes at a time
+// - compare, compare_view: compare two equal strings in separate buffers, with == on the same type or a std::string_view
+// - order: three-way compare two strings differing in their last byte
+// - clear: assign then clear, releasing the heap buffer if any
+template<typename S>
+static void bench_ops(const char* type_name, const BenchSource& src)
+{
+    const int COUNT = BenchSource::COUNT;
+    const double target_ms = 20.0;
+    volatile int sink = 0;
+    char name[96];
+
+    snprintf(name, sizeof(name), "set/%s/%s", type_name, src.Name);
+    if (bench_enabled(name))
+        bench_ops_print<S>(name, bench_run_timed(target_ms, COUNT, [&]()
+        {
+            S s;
+            for (int i = 0; i < COUNT; i++)
+            {
+                s = src.Views[0][i];
+                sink = sink + (int)s.size();
+            }
+        }));
+
+    if constexpr (!bench_is_std<S>)
+    {
+        snprintf(name, sizeof(name), "set_ref/%s/%s", type_name, src.Name);
+        if (bench_enabled(name))
+            bench_ops_print<S>(name, bench_run_timed(target_ms, COUNT, [&]()
+            {
+                S s;
+                for (int i = 0; i < COUNT; i++)
+                {
+                    s.set_ref(src.Views[0][i]);
+                    sink = sink + s.size();
+                }
+            }));
+    }
+
+    snprintf(name, sizeof(name), "setf/%s/%s", type_name, src.Name);
+    if (bench_enabled(name))
+        bench_ops_print<S>(name, bench_run_timed(target_ms, COUNT, [&]()
+        {
+            S s;
+            for (int i = 0; i < COUNT; i++)
+            {
+                bench_setf(s, src.Views[0][i]);
+                sink = sink + (int)s.size();
+            }
+        }));
+
+    snprintf(name, sizeof(name), "append/%s/%s", type_name, src.Name);
+    if (bench_enabled(name))
+        bench_ops_print<S>(name, bench_run_timed(target_ms, COUNT, [&]()
+        {
+            for (int i = 0; i < COUNT; i++)
+            {
+                S s;
+                std::string_view v = src.Views[0][i];
+                for (size_t offset = 0; offset < v.size(); offset += 16)
+                    s.append(v.substr(offset, 16));
+                sink = sink + (int)s.size();
+            }
+        }));
+
+    snprintf(name, sizeof(name), "appendf/%s/%s", type_name, src.Name);
+    if (bench_enabled(name))
+        bench_ops_print<S>(name, bench_run_timed(target_ms, COUNT, [&]()
+        {
+            for (int i = 0; i < COUNT; i++)
+            {
+                S s;
+                std::string_view v = src.Views[0][i];
+                for (size_t offset = 0; offset < v.size(); offset += 16)
+                    bench_appendf(s, v.substr(offset, 16));
+                sink = sink + (int)s.size();
+            }
+        }));
+
+    snprintf(name, sizeof(name), "compare/%s/%s", type_name, src.Name);
+    if (bench_enabled(name))
+    {
+        std::vector<S> lhs(COUNT), rhs(COUNT);
+        for (int i = 0; i < COUNT; i++)
+        {
+            lhs[i] = src.Views[0][i];
+            rhs[i] = src.Views[1][i];
+        }
+        bench_ops_print<S>(name, bench_run_timed(target_ms, COUNT, [&]()
+        {
+            for (int i = 0; i < COUNT; i++)
+                sink = sink + (lhs[i] == rhs[i] ? 1 : 0);
+        }));
+
+        snprintf(name, sizeof(name), "compare_view/%s/%s", type_name, src.Name);
+        if (bench_enabled(name))
+            bench_ops_print<S>(name, bench_run_timed(target_ms, COUNT, [&]()
+            {
+                for (int i = 0; i < COUNT; i++)
+                    sink = sink + (lhs[i] == src.Views[1][i] ? 1 : 0);
+            }));
+
+        // Differ in the last byte
+        for (int i = 0; i < COUNT; i++)
+            if (!src.Views[1][i].empty())
+                rhs[i] = std::string(src.Views[1][i].substr(0, src.Views[1][i].size() - 1)) + 'z';
+        snprintf(name, sizeof(name), "order/%s/%s", type_name, src.Name);
+        if (bench_enabled(name))
+            bench_ops_print<S>(name, bench_run_timed(target_ms, COUNT, [&]()
+            {
+                for (int i = 0; i < COUNT; i++)
+                    sink = sink + ((lhs[i] <=> rhs[i]) < 0 ? 1 : 0);
+            }));
+    }
+
+    snprintf(name, sizeof(name), "clear/%s/%s", type_name, src.Name);
+    if (bench_enabled(name))
+        bench_ops_print<S>(name, bench_run_timed(target_ms, COUNT, [&]()
+        {
+            S s;
+            for (int i = 0; i < COUNT; i++)
+            {
+                s = src.Views[0][i];
+                s.clear();
+                if constexpr (bench_is_std<S>)
+                    s.shrink_to_fit(); // Like Str::clear(), give the buffer back
+                sink = sink + (int)s.size();
+            }
+        }));
+}
+
+static void bench_ops_all_types(const BenchSource& src)
+{
+    bench_ops<Str>("Str", src);
+    bench_ops<Str16>("Str16", src);
+    bench_ops<Str32>("Str32", src);
+    bench_ops<Str64>("Str64", src);
+    bench_ops<Str128>("Str128", src);
+    bench_ops<Str256>("Str256", src);
+    bench_ops<std::string>("std_string", src);
+}
+
+//-------------------------------------------------------------------------
+// Scenarios
+//-------------------------------------------------------------------------
+
+// N small appends into an empty string, as done by log and path builders
+static void bench_append_loop(StrGrowth growth, const char* growth_name, int appends)
+{
+    const int iterations = appends >= 10000 ? 20 : 2000;
+    char name[64];
+    snprintf(name, sizeof(name), "append_loop/%s/%d", growth_name, appends);
+    volatile int sink = 0;
+    if (bench_enabled(name))
+        bench_print(name, bench_run(iterations, appends, [&]()
+        {
+            Str s;
+            s.set_growth(growth);
+            for (int i = 0; i < appends; i++)
+                s.append("piece/");
+            sink = sink + s.size();
+        }));
+
+    snprintf(name, sizeof(name), "appendf_loop/%s/%d", growth_name, appends);
+    if (bench_enabled(name))
+        bench_print(name, bench_run(iterations, appends, [&]()
+        {
+            Str64 s;
+            s.set_growth(growth);
+            for (int i = 0; i < appends; i++)
+                s.appendf("{}/", i);
+            sink = sink + s.size();
+        }));
+}
+
+// Typical request: build 500 strings of various lengths, then drop them all
+static void bench_request(bool use_arena)
+{
+    const int strings = 500;
+    const char* name = use_arena ? "request_500_strings/arena" : "request_500_strings/malloc";
+    if (!bench_enabled(name))
+        return;
+    volatile int sink = 0;
+    auto build_and_drop = [&]()
+    {
+        Str s[strings];
+        for (int i = 0; i < strings; i++)
+        {
+            s[i].setf("/api/v1/items/{}/details", i);
+            if (i & 1)
+                s[i].append("?format=json&fields=name,size,owner,created,updated");
+            sink = sink + s[i].size();
+        }
+    };
+    if (use_arena)
+        bench_print(name, bench_run(2000, strings, [&]() { StrArenaScope arena; build_and_drop(); }));
+    else
+        bench_print(name, bench_run(2000, strings, build_and_drop));
+}
+
+// Threads creating and dropping heap strings of sizes just above the local buffer, half of them freed by another thread
+template<typename STR>
+static void bench_churn(const char* name, int thread_count)
+{
+    char full_name[64];
+    snprintf(full_name, sizeof(full_name), "%s/%d_threads", name, thread_count);
+    if (!bench_enabled(full_name))
+        return;
+    const int strings_per_thread = 100000;
+    BenchResult r = bench_run(1, strings_per_thread * thread_count, [&]()
+    {
+        std::vector<std::thread> threads;
+        std::vector<std::vector<STR>> handoff(thread_count);
+        for (int t = 0; t < thread_count; t++)
+            threads.emplace_back([&, t]()
+            {
+                std::vector<STR>& out = handoff[(t + 1) % thread_count];
+                out.reserve(strings_per_thread / 2);
+                for (int i = 0; i < strings_per_thread; i++)
+                {
+                    STR s;
+                    s.setf("{:>{}}", "churn", 20 + (i * 7) % 100);
+                    if (i & 1)
+                        out.push_back(std::move(s));
+                }
+            });
+        for (std::thread& thread : threads)
+            thread.join();
+    });
+    bench_print(full_name, r);
+}
+
+// Lookups of identifier-like keys (hits and misses) in a map keyed by strings
+template<typename MAP>
+static void bench_map_lookup(const char* name, int key_count)
+{
+    char full_name[64];
+    snprintf(full_name, sizeof(full_name), "%s/%d_keys", name, key_count);
+    if (!bench_enabled(full_name))
+        return;
+    std::vector<Str> keys(key_count * 2);
+    for (int i = 0; i < key_count * 2; i++)
+        keys[i].setf("field_{}_{}", i * 2654435761u % 100000, i);
+    MAP map;
+    for (int i = 0; i < key_count; i++)
+        map[keys[i].view()] = i;
+    volatile int sink = 0;
+    bench_print(full_name, bench_run_timed(20.0, key_count * 2, [&]()
+    {
+        for (const Str& key : keys)
+        {
+            auto it = map.find(key.view());
+            sink = sink + (it != map.end());
+        }
+    }));
+}
+
+// One payload handed to 16 consumers that only read it, as deep copies or copies of a shared buffer
+static void bench_fan_out(int payload_size, bool shared)
+{
+    char full_name[64];
+    snprintf(full_name, sizeof(full_name), "fan_out_16/%d/%s", payload_size, shared ? "shared" : "deep");
+    if (!bench_enabled(full_name))
+        return;
+    Str payload;
+    payload.setf("{:>{}}", "payload", payload_size);
+    if (shared)
+        payload.make_shared();
+    volatile int sink = 0;
+    bench_print(full_name, bench_run_timed(20.0, 16, [&]()
+    {
+        Str consumers[16];
+        for (Str& consumer : consumers)
+            consumer = payload;
+        for (const Str& consumer : consumers)
+            sink = sink + consumer[0];
+    }));
+}
+
+// Build a ~4MB report of small rows and some large blocks, with Str::append or StrBuilder then finish()
+static void bench_report(bool use_builder)
+{
+    const char* name = use_builder ? "report_4MB/builder" : "report_4MB/append";
+    if (!bench_enabled(name))
+        return;
+    Str block;
+    block.setf("{:>{}}", "block", 4000);
+    volatile int sink = 0;
+    const int rows = 100000;
+    bench_print(name, bench_run(10, rows, [&]()
+    {
+        Str out;
+        if (use_builder)
+        {
+            StrBuilder builder;
+            for (int i = 0; i < rows; i++)
+            {
+                builder.append("<tr><td>item</td><td>");
+                builder.appendf("{}", i);
+                builder.append("</td></tr>\n");
+                if (i % 100 == 0)
+                    builder.append(block.view());
+            }
+            builder.finish(&out);
+        }
+        else
+        {
+            for (int i = 0; i < rows; i++)
+            {
+                out.append("<tr><td>item</td><td>");
+                out.appendf("{}", i);
+                out.append("</td></tr>\n");
+                if (i % 100 == 0)
+                    out.append(block.view());
+            }
+        }
+        sink = sink + out.size();
+    }));
+}
+
+// Threads interning a shared set of metric names, nearly all of them already in the table
+static void bench_intern(int thread_count)
+{
+    char full_name[64];
+    snprintf(full_name, sizeof(full_name), "intern/%d_threads", thread_count);
+    if (!bench_enabled(full_name))
+        return;
+    const int names = 1000, lookups_per_thread = 200000;
+    std::vector<Str32> keys(names);
+    for (int i = 0; i < names; i++)
+        keys[i].setf("service.requests.{}.latency", i);
+    BenchResult r = bench_run(1, lookups_per_thread * thread_count, [&]()
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; t++)
+            threads.emplace_back([&, t]()
+            {
+                size_t sink = 0;
+                for (int i = 0; i < lookups_per_thread; i++)
+                    sink += Str::intern(keys[(i + t * 97) % names].view()).size();
+                if (sink == 0)
+                    printf("\n");
+            });
+        for (std::thread& thread : threads)
+            thread.join();
+    });
+    bench_print(full_name, r);
+}
+
+// Write an HTTP-like response of 160 small header pieces and a 16KB body to a file: concatenated then write(),
+// one iovec entry per piece with StrWriteAll(), or StrIoVec (small pieces coalesced)
+static void bench_write_response(int mode)
+{
+    static const char* names[] = { "write_response/concat", "write_response/writev", "write_response/StrIoVec" };
+    const char* name = names[mode];
+    if (!bench_enabled(name))
+        return;
+    std::vector<Str> pieces;
+    pieces.emplace_back("HTTP/1.1 200 OK\r\n");
+    for (int i = 0; i < 40; i++)
+    {
+        pieces.emplace_back().setf("x-header-{}", i);
+        pieces.emplace_back(": ");
+        pieces.emplace_back().setf("value-{}", i * 7919);
+        pieces.emplace_back("\r\n");
+    }
+    pieces.emplace_back("\r\n");
+    pieces.emplace_back().setf("{:>{}}", "body", 16 * 1024);
+    FILE* f = tmpfile();
+    int fd = fileno(f);
+    bench_print(name, bench_run_timed(50.0, 1, [&]()
+    {
+        lseek(fd, 0, SEEK_SET);
+        if (mode == 0)
+        {
+            Str out;
+            for (const Str& piece : pieces)
+                out.append(piece.view());
+            ssize_t written = write(fd, out.c_str(), out.size());
+            (void)written;
+        }
+        else if (mode == 1)
+        {
+            struct iovec iov[256];
+            int count = 0;
+            for (const Str& piece : pieces)
+            {
+                iov[count].iov_base = (void*)piece.c_str();
+                iov[count].iov_len = piece.size();
+                count++;
+            }
+            StrWriteAll(fd, iov, count);
+        }
+        else
+        {
+            StrIoVec out(fd);
+            for (const Str& piece : pieces)
+                out.add(piece);
+            out.flush();
+        }
+    }));
+    fclose(f);
+}
+
+// Format a typical log line into a Str256, with a runtime format string or FMT_COMPILE()
+static void bench_log_line(bool compiled)
+{
+    const char* name = compiled ? "log_line/setf_compiled" : "log_line/setf";
+    if (!bench_enabled(name))
+        return;
+    Str256 line;
+    volatile int sink = 0;
+    int i = 0;
+    bench_print(name, bench_run_timed(20.0, 1, [&]()
+    {
+        i++;
+        if (compiled)
+            line.setf(FMT_COMPILE("[{}] {}:{} request {} done in {}us status={}"), "info", "server.cpp", 412, i, i % 977, 200);
+        else
+            line.setf("[{}] {}:{} request {} done in {}us status={}", "info", "server.cpp", 412, i, i % 977, 200);
+        sink = sink + (int)line.size();
+    }));
+}
+
+// Append one number to a Str256 with appendf("{}") or the dedicated append_int/append_uint/append_double
+template<typename FUNC>
+static void bench_append_number(const char* name, FUNC&& append_func)
+{
+    if (!bench_enabled(name))
+        return;
+    Str256 s;
+    volatile int sink = 0;
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    bench_print(name, bench_run_timed(20.0, 1, [&]()
+    {
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+        s.clear();
+        append_func(s, x);
+        sink = sink + (int)s.size();
+    }));
+}
+
+// Threads appending 64 byte log lines to one shared buffer: Str::append under a mutex, or StrAppendBuffer (lock-free)
+static void bench_concurrent_log(int thread_count, bool lock_free)
+{
+    char full_name[64];
+    snprintf(full_name, sizeof(full_name), "concurrent_log/%d/%s", thread_count, lock_free ? "StrAppendBuffer" : "mutex");
+    if (!bench_enabled(full_name))
+        return;
+    const int lines_per_thread = 100000;
+    const size_t capacity = (size_t)thread_count * lines_per_thread * 64;
+    Str line;
+    line.setf("{:<63}\n", "2024-01-01T00:00:00Z info request done status=200");
+    StrAppendBuffer buffer(capacity);
+    Str locked;
+    locked.reserve(capacity + 1);
+    std::mutex mutex;
+    volatile size_t sink = 0;
+    bench_print(full_name, bench_run(5, lines_per_thread * thread_count, [&]()
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; t++)
+            threads.emplace_back([&]()
+            {
+                for (int i = 0; i < lines_per_thread; i++)
+                {
+                    if (lock_free)
+                    {
+                        buffer.append(line.view());
+                    }
+                    else
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        locked.append_nogrow(line.view());
+                    }
+                }
+            });
+        for (std::thread& thread : threads)
+            thread.join();
+        if (lock_free)
+            sink = sink + buffer.flush([](std::string_view) {});
+        else
+            sink = sink + locked.size();
+        locked.set("");
+    }));
+}
+
+// Searches in a 1KB block of HTTP headers: Str kernels vs std::string_view
+template<typename FUNC>
+static void bench_search(const char* name, FUNC&& search_func)
+{
+    if (!bench_enabled(name))
+        return;
+    Str headers;
+    for (int i = 0; i < 24; i++)
+        headers.appendf("x-header-field-{:02}: some-value-{:08}\r\n", i, i * 7919);
+    headers.append("x-request-id: 3f2a\r\n\r\n");
+    volatile size_t sink = 0;
+    bench_print(name, bench_run_timed(20.0, 1, [&]()
+    {
+        sink = sink + search_func(headers);
+    }));
+}
+
+// Parse "key=value;" lines: copy each key and value into a Str, or iterate StrSplit references
+static void bench_parse_kv(bool use_split)
+{
+    const char* name = use_split ? "parse_kv_line/split_refs" : "parse_kv_line/copy";
+    if (!bench_enabled(name))
+        return;
+    Str line;
+    for (int i = 0; i < 16; i++)
+        line.appendf("field_{}=some value {};", i, i * 7919);
+    volatile size_t sink = 0;
+    bench_print(name, bench_run_timed(20.0, 16, [&]()
+    {
+        size_t total = 0;
+        if (use_split)
+        {
+            for (Str kv : line.split(';', StrSplitFlags_SkipEmpty))
+                for (Str part : kv.split('=', 0, 1))
+                    total += part.size();
+        }
+        else
+        {
+            std::string_view rest = line.view();
+            while (!rest.empty())
+            {
+                size_t end = rest.find(';');
+                std::string_view kv = rest.substr(0, end);
+                size_t eq = kv.find('=');
+                Str key = kv.substr(0, eq);
+                Str value = kv.substr(eq + 1);
+                total += key.size() + value.size();
+                rest = (end == std::string_view::npos) ? std::string_view() : rest.substr(end + 1);
+            }
+        }
+        sink = sink + total;
+    }));
+}
+
+// Load a 64MB file (in the page cache) and touch one byte per page, read() into a heap Str or mapped with Str::map_file()
+static void bench_load_file(bool mapped)
+{
+    const char* name = mapped ? "load_file_64MB/map_file" : "load_file_64MB/read";
+    if (!bench_enabled(name))
+        return;
+    const char* path = "/tmp/str_bench_load_file.bin";
+    const size_t size = 64 * 1024 * 1024;
+    {
+        std::string contents(size, 'x');
+        FILE* f = fopen(path, "wb");
+        fwrite(contents.data(), 1, size, f);
+        fclose(f);
+    }
+    volatile int sink = 0;
+    bench_print(name, bench_run(10, 1, [&]()
+    {
+        Str file;
+        if (mapped)
+        {
+            file = Str::map_file(path);
+        }
+        else
+        {
+            FILE* f = fopen(path, "rb");
+            file.reserve_discard(size + 1);
+            static char buf[64 * 1024];
+            while (size_t read_size = fread(buf, 1, sizeof(buf), f))
+                file.append(std::string_view(buf, read_size));
+            fclose(f);
+        }
+        for (size_t i = 0; i < file.size(); i += 4096)
+            sink = sink + file.c_str()[i];
+    }));
+    remove(path);
+}
+
+// Minimal wrappers giving both maps the same operator[]/find()/end() shape
+struct BenchStdMap
+{
+    std::unordered_map<Str, int, StrHash, std::equal_to<>> Map;
+    int&        operator[](std::string_view key)    { return Map.try_emplace(Str(key)).first->second; }
+    auto        find(std::string_view key)          { return Map.find(key); }
+    auto        end()                               { return Map.end(); }
+};
+struct BenchFlatMap
+{
+    StrHashMap<int> Map;
+    int&        operator[](std::string_view key)    { return Map[key]; }
+    int*        find(std::string_view key)          { return Map.find(key); }
+    int*        end()                               { return NULL; }
+};
+
+// Usage: bench [--json|--csv] [--filter <substring>]
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            g_format = BenchFormat_Json;
+        else if (strcmp(argv[i], "--csv") == 0)
+            g_format = BenchFormat_Csv;
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            g_filter = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: %s [--json|--csv] [--filter <substring>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_begin();
+
+    const BenchSource sources[] =
+    {
+        BenchSource("0-16", 0, 16),
+        BenchSource("16-256", 16, 256),
+        BenchSource("1K", 1024, 1024),
+        BenchSource("64K", 64 * 1024, 64 * 1024),
+    };
+    for (const BenchSource& src : sources)
+        bench_ops_all_types(src);
+
+    const int appends_counts[] = { 16, 256, 4096, 65536 };
+    for (int appends : appends_counts)
+    {
+        bench_append_loop(StrGrowth_Exact, "exact", appends);
+        bench_append_loop(StrGrowth_Default, "default", appends);
+        bench_append_loop(StrGrowth_Factor2, "2x", appends);
+        bench_append_loop(StrGrowth_Factor1_5, "1.5x", appends);
+    }
+    bench_request(false);
+    bench_request(true);
+    for (int thread_count : { 1, 4, 8 })
+    {
+        bench_churn<Str16>("churn/malloc", thread_count);
+        bench_churn<StrN<16, StrPoolAllocator>>("churn/pool", thread_count);
+    }
+    for (int key_count : { 100, 10000, 1000000 })
+    {
+        bench_map_lookup<BenchStdMap>("map_lookup/unordered_map", key_count);
+        bench_map_lookup<BenchFlatMap>("map_lookup/StrHashMap", key_count);
+    }
+    for (int thread_count : { 1, 4, 8 })
+        bench_intern(thread_count);
+    bench_report(false);
+    bench_report(true);
+    for (int payload_size : { 256, 64 * 1024 })
+    {
+        bench_fan_out(payload_size, false);
+        bench_fan_out(payload_size, true);
+    }
+    bench_load_file(false);
+    bench_load_file(true);
+    for (int mode = 0; mode < 3; mode++)
+        bench_write_response(mode);
+    bench_log_line(false);
+    bench_log_line(true);
+    bench_append_number("append_number/int32/appendf", [](Str& s, uint64_t x) { s.appendf("{}", (int32_t)x); });
+    bench_append_number("append_number/int32/append_int", [](Str& s, uint64_t x) { s.append_int((int32_t)x); });
+    bench_append_number("append_number/uint64/appendf", [](Str& s, uint64_t x) { s.appendf("{}", x); });
+    bench_append_number("append_number/uint64/append_uint", [](Str& s, uint64_t x) { s.append_uint(x); });
+    bench_append_number("append_number/double/appendf", [](Str& s, uint64_t x) { s.appendf("{}", (double)(x >> 11) * 0x1.0p-40); });
+    bench_append_number("append_number/double/append_double", [](Str& s, uint64_t x) { s.append_double((double)(x >> 11) * 0x1.0p-40); });
+    bench_search("search_1KB/find_str/string_view", [](const Str& s) { return s.view().find("x-request-id"); });
+    bench_search("search_1KB/find_str/Str", [](const Str& s) { return s.find("x-request-id"); });
+    bench_search("search_1KB/rfind_str/string_view", [](const Str& s) { return s.view().rfind("x-header-field-00"); });
+    bench_search("search_1KB/rfind_str/Str", [](const Str& s) { return s.rfind("x-header-field-00"); });
+    bench_search("search_1KB/find_char/string_view", [](const Str& s) { return s.view().find('#'); });
+    bench_search("search_1KB/find_char/Str", [](const Str& s) { return s.find('#'); });
+    bench_search("search_1KB/find_first_of/string_view", [](const Str& s) { return s.view().find_first_of("#?&"); });
+    bench_search("search_1KB/find_first_of/Str", [](const Str& s) { static const StrByteSet set("#?&"); return s.find_first_of(set); });
+    bench_search("search_1KB/find_first_not_of/string_view", [](const Str& s) { return s.view().find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789-:\r\n "); });
+    bench_search("search_1KB/find_first_not_of/Str", [](const Str& s) { static const StrByteSet set("abcdefghijklmnopqrstuvwxyz0123456789-:\r\n "); return s.find_first_not_of(set); });
+    bench_parse_kv(false);
+    bench_parse_kv(true);
+    for (int thread_count : { 1, 2, 4, 8 })
+    {
+        bench_concurrent_log(thread_count, false);
+        bench_concurrent_log(thread_count, true);
+    }
+
+    bench_end();
+    return 0;
+}
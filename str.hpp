@@ -1,5 +1,5 @@
 /*
-# Str v0.40
+# Str v0.66
 ## Simple C++ string type with an optional local buffer, by Omar Cornut, cloud11665
 https://github.com/cloud11665/str
 
@@ -14,13 +14,14 @@ https://github.com/cloud11665/str
 ### Note:
 - This isn't a fully featured string class.
 - It is a simple, bearable replacement to std::string that isn't heap abusive nor bloated (can actually be debugged by humans).
-- Local buffer size is currently limited to 1023 bytes (we allocate 10 bits to hold local buffer size).
+- Local buffer sizes go up to 64 KiB: any size below 256, multiples of 256 above (checked at compile time by StrN).
 - In "non-owned" mode for literals/reference we don't do any tracking/counting of references.
 
 The main idea is that you can provide an arbitrary sized local buffer if you expect string to fit most of the time, and then you avoid using costly heap.
 ```cpp
-// No local buffer, always use heap, sizeof()==16
-    Str s1 = "hey"; // allocates
+// No local buffer, sizeof()==16: up to 14 characters are stored inline (STR_SSO), longer strings use heap
+    Str s1 = "hey"; // doesn't allocate
+    Str s1 = "long_filename_not_very_long_but_longer_than_expected.h";    // allocates
     Str s2 = Str::ref("hey"); // doesn't allocate
 // With a local buffer of 16 bytes, sizeof() == 16 + 16 bytes.
     Str16 s = "filename.h"; // copy into local buffer
@@ -37,7 +38,23 @@ The main idea is that you can provide an arbitrary sized local buffer if you exp
     s.setf("{}/{}.tmp", folder, filename);   // set (w/format)
     s.append("hello");                       // append.
     s.appendf("hello {}", 42);               // append (w/format).
+    s.appendf(FMT_COMPILE("#{} "), id);      // same with a format parsed at compile time (hot paths)
+    size_t i = s.find("sailor");             // also rfind, find(char), contains, starts_with, ends_with (npos when not found)
+    size_t j = s.find_first_of(StrByteSet("/?#"));   // find_first_of/find_first_not_of, with the set built once
+    for (Str field : s.split(','))           // references to the pieces, no copy (also string and StrByteSet delimiters, StrSplitFlags_SkipEmpty, split limit)
+    s.append_int(-42);                       // append a number without fmt: also append_uint, append_hex, append_double (shortest round-trip) and _nogrow variants
     s.set_ref("Hey!");                       // set (literal/reference, just copy pointer, no tracking)
+    s.set_growth(StrGrowth_Exact);           // change how append/appendf grow the heap buffer for this instance
+```
+
+Growth policy:
+```cpp
+    // append(), appendf() and operator+= grow the heap buffer geometrically so that appending in a loop is amortized O(1).
+    // reserve() always allocates exactly what was asked for.
+    Str s;                                   // StrGrowth_Default: 2x while small, 1.5x past STR_GROWTH_THRESHOLD bytes.
+    StrN<64, StrDefaultAllocator, StrGrowth_Factor2> s2; // select the policy per type...
+    s.set_growth(StrGrowth_Factor1_5);       // ...or per instance.
+    s.set_growth(StrGrowth_Exact);           // old behavior: every append reallocates to the exact size.
 ```
 
 Constructor helper for reference/literal:
@@ -51,14 +68,199 @@ All StrN types derives from Str and instance hold the local buffer capacity. So
     void MyFunc(Str* s) { *s = "Hello"; }    // will use local buffer if available in Str instance
 ```
 
+Custom allocators: StrN<N, ALLOC> sends its heap allocations to ALLOC, which can be stateful. It still derives from Str and can be passed around as a Str*:
+```cpp
+    struct ArenaAllocator
+    {
+        MyArena* Arena;
+        void*   allocate(size_t size)               { return Arena->Alloc(size); }
+        void    deallocate(void* ptr, size_t size)  { Arena->Free(ptr, size); }
+        bool    operator==(const ArenaAllocator& rhs) const { return Arena == rhs.Arena; }
+    };
+    StrN<64, ArenaAllocator> s(ArenaAllocator{ &request_arena });   // local buffer, then heap from request_arena
+    StrN<0, ArenaAllocator> h(ArenaAllocator{ &request_arena });    // heap only
+    MyFunc(&s);
+```
+Str and StrN<N> use StrDefaultAllocator, which calls STR_MEMALLOC/STR_MEMFREE.
+
+Heap buffers can come from a size-class pool with per-thread caches, which takes malloc out of string churn (capacity is rounded up to the size class, so later appends use the slack):
+```cpp
+    StrN<32, StrPoolAllocator> s;            // per type
+    #define STR_USE_POOL 1                   // or for all strings with the default allocator (before including str.hpp)
+```
+
+Request-scoped strings can come from a bump arena: while a StrArenaScope is alive on a thread, heap allocations of strings using the default allocator come from it, frees are no-ops, and everything is released when the scope ends:
+```cpp
+    void HandleRequest()
+    {
+        StrArenaScope arena;
+        Str s;
+        s.setf("{}/{}.tmp", folder, filename);   // from the arena
+    }                                            // all strings must be gone by now (checked in debug builds)
+```
+
+Comparisons check sizes first, then compare bytes with SSE2/AVX2 kernels (AVX2 is picked at runtime). Strings of up to 16 bytes
+whose buffers have room for 16 bytes (e.g. local buffers) are compared with a single vector load:
+```cpp
+    Str64 a = "GET"; Str64 b = "GET";
+    a == b;  a < b;  a == "GET";  (a <=> "POST") < 0;
+    #define STR_SIMD_AVX2 0                  // SSE2 only (before including str.hpp). STR_SIMD 0 for plain C++.
+```
+
+Hashing: Str, StrN, std::string_view and C strings with the same contents hash the same, so maps keyed by Str can be
+searched without building a Str. Keys hashed often can cache their hash, and StrHashMap keeps short keys inline in its entries:
+```cpp
+    std::unordered_map<Str, int, StrHash, std::equal_to<>> map;
+    map.find(std::string_view("key"));       // no temporary Str
+    StrHashed<Str32> key = "content-type";   // hash computed once, until the string is modified
+    StrHashMap<int> headers;                 // keys up to 31 bytes stored in the 64 bytes entries, linear probing
+    headers["content-length"] = 42;
+    if (int* v = headers.find("content-length")) { ... }
+```
+
+To build large outputs, StrBuilder collects the pieces and concatenates them once (or writes them with writev() without
+concatenating at all). Pieces of STR_BUILDER_REF_MIN_SIZE bytes or more are referenced, not copied, so they must outlive it:
+```cpp
+    StrBuilder b;
+    b.append("<table>");                     // copied into a slab
+    b.append(rows_html.view());              // large: referenced
+    b.appendf("<p>{} rows</p>", count);      // formatted into a slab
+    Str page = b.finish();                   // single allocation of the exact size
+    b.write(socket_fd);                      // or gathered write of the pieces (STR_POSIX)
+```
+
+When the pieces already exist, StrIoVec writes them with writev() directly (STR_POSIX). Pieces are referenced until the
+next flush(), except the small ones (up to STR_IOVEC_COALESCE_MAX_SIZE bytes) which are copied into a scratch buffer so
+a run of them takes a single iovec entry. Partial writes, EINTR and IOV_MAX are handled:
+```cpp
+    StrIoVec out(socket_fd);
+    out.add(status_line);
+    for (const Header& h : headers) { out.add(h.name); out.add(": "); out.add(h.value); out.add("\r\n"); }
+    out.add(body);
+    if (out.flush() < 0) perror("write");
+    Str::write_all(socket_fd, pieces);       // same for a std::span<const Str* const>
+```
+
+Large strings handed to many readers can be put in a shared heap buffer with a reference count: copies then share it in O(1),
+and the first modification of a copy (set, append, setf, non-const operator[]...) gives it its own buffer back:
+```cpp
+    Str config = Str::shared(LoadFile("config.json"));  // or s.make_shared() on an existing string
+    Str copy = config;                       // no allocation, no copy: config.shared_count() == 2
+    copy.append("\n");                       // copy detaches, config is unchanged
+    char c = std::as_const(config)[0];       // reading through a non-const operator[] would detach too
+```
+
+Repeated identifiers (metric names, header names...) can be interned: Str::intern() returns a reference to a deduplicated,
+immutable copy kept until exit, so equal interned strings share one pointer, which Str == Str checks before comparing bytes:
+```cpp
+    Str a = Str::intern("content-type");     // copied into the table once
+    Str b = Str::intern(header_name);        // no allocation if already interned
+    a.c_str() == b.c_str();                  // same contents, same pointer
+    StrInternPool::Stats stats = StrInternPool::get_stats();   // stats.Count, stats.Bytes, stats.get_hit_rate()
+```
+
+Strings aren't limited to 16 MiB: sizes and capacities up to SMALL_MAX (16 MiB - 1) are held in the 24-bit fields,
+larger ones switch the string to a large mode where the size uses both fields and an owned heap buffer is preceded by a
+StrLargeHeader holding its capacity. Small strings never touch the header, and sizeof(Str) stays 16:
+```cpp
+    Str s = LoadFile("dump.bin");            // 100 MiB: s.size() is a size_t
+    Str r = Str::ref(mapped_view);           // references and shared buffers of any size, no header
+```
+
+References and StrN filled from literals can be built during constant evaluation, so global tables of constants can be
+constinit and need no dynamic initializer at startup (Str from a literal still copies at runtime: use Str::ref() or a StrN):
+```cpp
+    constinit Str g_methods[] = { Str::ref("GET"), Str::ref("POST") };
+    constinit Str32 g_defaults[] = { "localhost", "8080" };   // copied into the local buffers at compile time
+    constexpr Str k_name = Str::ref("server");              // k_name.size() is usable in constant expressions
+```
+
+Load a whole file without copying it (STR_POSIX). Regular files are mmap()-ed read-only and the page after the data reads
+as the zero terminator; pipes and special files fall back to read(). A mapped Str behaves like a shared one: copies share
+the mapping, the last one unmaps it, and the first write copies the contents out to a private buffer:
+```cpp
+    Str config = Str::map_file("config.json");                  // empty on failure
+    if (!data.set_mapped_file(path)) perror(path);              // false + errno on failure, data left unchanged
+```
+
+Several threads can append to one StrAppendBuffer without a lock: each append reserves its range with an atomic
+compare-exchange on the size and copies into it. A full buffer fails appends like append_nogrow(). flush() swaps in the second buffer, so
+producers keep appending while the first one is written out:
+```cpp
+    StrAppendBuffer log(1 << 20);            // two buffers of 1 MiB
+    log.append(line);                        // from any thread: line.size(), or -1 if full
+    log.flush([&](std::string_view s) { fwrite(s.data(), 1, s.size(), f); });
+```
+
+Str and StrN are copyable and movable. Copies are deep (except for references, which stay references), moves steal the heap buffer:
+```cpp
+    std::vector<Str> v;
+    v.push_back(Str("hello"));               // moved, no extra allocation
+    Str256 a = "in local buffer";
+    Str b = std::move(a);                    // data is in a's local buffer: copies the used bytes only
+```
+
+To pick local buffer sizes from data, build with STR_TELEMETRY=1 and poll the counters (compiled out otherwise):
+```cpp
+    #define STR_TELEMETRY 1                  // before including str.hpp
+    StrTelemetry t = StrTelemetry::get_global();     // or get_thread()
+    for (int i = 0; i < StrTelemetryCounter_COUNT; i++)
+        export_metric(StrTelemetry::get_counter_name(i), t.Counters[i]);
+    t.Counters[StrTelemetry::get_spill_counter(64)]; // how often a local buffer of 64..127 bytes was too small
+    Str report; t.dump(&report);            // "reserve_local 1234\n..."
+```
+
+To size local buffers per declaration site, build with STR_PROFILE_SITES=1. StrN constructors then capture their call site and
+destructors record final size and peak capacity needed into per-site histograms:
+```cpp
+    #define STR_PROFILE_SITES 1              // before including str.hpp. Adds 8 bytes to Str, C++20 <source_location>.
+    Str report;
+    StrSiteProfiler::report(&report);        // "src/http.cpp:42:15 void parse() StrN<16> count=12000 spills=8.3% max_peak=90 suggest p95=StrN<32> p99=StrN<128>"
+```
+
 ## Testing the code:
     g++ -std=c++20 -g test.cpp -o test -lfmt
     valgrind ./test
+    g++ -std=c++20 -g test_instrumented.cpp -o test_instrumented -lfmt   # same tests with STR_TELEMETRY and STR_PROFILE_SITES
+    ./test_instrumented
+
+## Benchmarking:
+    g++ -std=c++20 -O2 bench.cpp -o bench -lfmt
+    ./bench                                  # set/set_ref/setf/append/appendf/compare/clear x lengths x Str, Str16..Str256, std::string, then scenarios
+    ./bench --json > before.json             # or --csv, to diff runs across commits
+    ./bench --filter append/Str64            # only run benchmarks whose name contains a substring
+Each result reports ns/op, heap allocations/op, bytes allocated/op and bytes copied/op (counted through STR_MEMCPY).
 
 */
 
 /*
  CHANGELOG
+  0.66 - fixed setf_nogrow/appendf_nogrow writing the terminator into referenced or read-only storage when the string had no writable room. fixed StrAppendBuffer failed appends accumulating in the reserved size until it overflowed: ranges are now reserved with a compare-exchange that refuses them past the end.
+  0.65 - added StrSplit and Str::split(): lazy range of references to the pieces between char, string or StrByteSet delimiters, no copy nor allocation. StrSplitFlags_SkipEmpty, split count limit.
+  0.64 - added find/rfind (char and substring), find_first_of/find_first_not_of (StrByteSet), contains, starts_with, ends_with. substring searches filter on the first and last byte with SSE2/AVX2, byte sets use AVX2 nibble table lookups.
+  0.63 - added StrAppendBuffer: lock-free multi-producer append buffer (one fetch_add per append, fails when full), double buffered so flush() runs while producers keep appending.
+  0.62 - added append_int/append_uint/append_hex/append_double (and _nogrow): numbers appended without fmt, in place when there is room for the longest output (StrNumber kernels: digit pairs, std::to_chars shortest round-trip for doubles).
+  0.61 - setf/appendf (and _nogrow) accept FMT_COMPILE() formats: parsed at compile time, literal parts copied straight into the string.
+  0.60 - added StrIoVec and Str::write_all() (STR_POSIX): gathered writev() of many pieces without concatenating, small pieces coalesced into a scratch buffer. added STR_IOVEC_BATCH, STR_IOVEC_COALESCE_MAX_SIZE, STR_IOVEC_SCRATCH_SIZE.
+  0.59 - added Str::map_file() and set_mapped_file() (STR_POSIX): regular files are mmap()-ed read-only behind a shared header (MapOffset), pipes and special files fall back to read().
+  0.58 - Str::ref() and StrN constructors from literals are constexpr, so tables of constants can be constinit (no dynamic initializer). EmptyBuffer is a constexpr array.
+  0.57 - local buffers up to 64 KiB (sizes below 256, or multiples of 256): m_local_size is 9 bits, encoded. StrN static_asserts valid sizes. fixed Str256, whose local size was truncated to 0. inline mode is now flagged by m_owned + m_shared.
+  0.56 - added STR_SSO (default on little-endian targets): a Str without local buffer keeps up to 14 characters in its own 16 bytes instead of allocating. shrink_to_fit() moves small heap strings back inline.
+  0.55 - sizes and capacities are size_t: strings over 16 MiB switch to a large mode (48-bit size split over m_size/m_capacity, capacity in a StrLargeHeader before owned heap buffers). size()/capacity() return size_t, append() returns ptrdiff_t.
+  0.54 - added StrBuilder: collects pieces (small ones copied into slabs, large ones referenced), finish() concatenates with one exact allocation, write() uses writev(). added StrWriteAll() and STR_POSIX.
+  0.53 - added shared mode: set_shared()/make_shared()/Str::shared() put the contents in a refcounted heap buffer, copies share it and the first write detaches. operator[] takes an int (negative indices count from the end, were broken with size_t).
+  0.52 - added Str::intern() and StrInternPool: process-wide sharded table of immutable deduplicated strings (lock-free lookups, per-shard locks for inserts), with stats. Str == Str checks for a shared pointer first.
+  0.51 - added Str::hash() (StrSimd::hash, 64-bit multiply-mix), transparent StrHash functor and std::hash specializations, StrHashed<STR> with a cached hash, and StrHashMap<VALUE> (open addressing, keys inline in 64 bytes entries).
+  0.50 - added Str == Str, Str <=> Str and const char* comparisons. comparisons use StrSimd kernels (STR_SIMD: SSE2, STR_SIMD_AVX2: AVX2 selected at runtime), short strings with buffer slack compare with a single vector load.
+  0.49 - added StrSiteProfiler (STR_PROFILE_SITES): StrN constructors capture std::source_location, per-site histograms of final sizes and peak capacities, with local buffer size suggestions.
+  0.48 - added StrTelemetry (STR_TELEMETRY): per-thread and global counts of local/heap reserves, heap bytes, reserve copies and local buffer spills by local size.
+  0.47 - added STR_MEMCPY hook for copies of string contents. append_nogrow() copies with memcpy (was strncpy, which stopped at zeros). bench.cpp covers all operations/sizes/types with JSON and CSV output.
+  0.46 - added StrPool/StrPoolAllocator (size classes, per-thread caches, global depot) and STR_USE_POOL. allocators can round capacity up with good_size().
+  0.45 - added StrArenaScope to serve heap buffers from a scoped per-thread bump arena.
+  0.44 - added allocator template parameter StrN<N, ALLOC> (StrDefaultAllocator uses STR_MEMALLOC/STR_MEMFREE). breaking change: growth policy moved to third StrN parameter.
+  0.43 - added copy and move constructors/assignments (implicit ones were shallow). set() no longer reads one byte past the source.
+  0.42 - setf/appendf format in a single pass straight into the string storage. fixed setf not updating size, setf_nogrow growing.
+  0.41 - added growth policy (StrGrowth_XXX), append/appendf/operator+= now grow geometrically. added bench.cpp.
   0.40 - Added libfmt support, reworked api.
   0.32 - added owned() accessor.
   0.31 - fixed various warnings.
@@ -91,6 +293,11 @@ All StrN types derives from Str and instance hold the local buffer capacity. So
 #include <stdlib.h>
 #endif
 
+// Copies of string contents go through STR_MEMCPY (e.g. to count bytes copied when benchmarking)
+#ifndef STR_MEMCPY
+#define STR_MEMCPY    memcpy
+#endif
+
 #ifndef STR_ASSERT
 #define STR_ASSERT    assert
 #include <assert.h>
@@ -100,142 +307,1141 @@ All StrN types derives from Str and instance hold the local buffer capacity. So
 #define STR_API
 #endif
 
+// Growth policy used by Str instances that don't select one (see StrGrowth below)
+#ifndef STR_DEFAULT_GROWTH
+#define STR_DEFAULT_GROWTH          StrGrowth_Default
+#endif
+
+// Capacity past which StrGrowth_Default switches from 2x to 1.5x
+#ifndef STR_GROWTH_THRESHOLD
+#define STR_GROWTH_THRESHOLD        4096
+#endif
+
+// Store strings of up to 14 characters inside a plain Str (no local buffer) instead of allocating. Relies on the
+// little-endian bitfield layout of Str, so it is off on big-endian targets.
+#ifndef STR_SSO
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define STR_SSO                     0
+#else
+#define STR_SSO                     1
+#endif
+#endif
+
+// Size of the blocks StrArenaScope allocates (through STR_MEMALLOC) to serve strings from
+#ifndef STR_ARENA_CHUNK_SIZE
+#define STR_ARENA_CHUNK_SIZE        (64 * 1024)
+#endif
+
+// Route heap buffers of strings using the default allocator through StrPool (size classes + per-thread caches)
+#ifndef STR_USE_POOL
+#define STR_USE_POOL                0
+#endif
+
+// Largest buffer served by StrPool, bigger ones go to STR_MEMALLOC
+#ifndef STR_POOL_MAX_SIZE
+#define STR_POOL_MAX_SIZE           (32 * 1024)
+#endif
+
+// Number of blocks moved at once between a thread cache and the global depot
+#ifndef STR_POOL_BATCH_SIZE
+#define STR_POOL_BATCH_SIZE         32
+#endif
+
+// Check that strings allocated in a StrArenaScope don't outlive it (enabled in debug builds)
+#ifndef STR_ARENA_CHECKS
+#ifdef NDEBUG
+#define STR_ARENA_CHECKS            0
+#else
+#define STR_ARENA_CHECKS            1
+#endif
+#endif
+
+// Count reserve outcomes, heap traffic, copies and local buffer spills per thread, see StrTelemetry (no cost when disabled)
+#ifndef STR_TELEMETRY
+#define STR_TELEMETRY               0
+#endif
+
+// Record final sizes and peak capacities of StrN instances per declaration site, see StrSiteProfiler (changes StrN constructors and sizeof(Str))
+#ifndef STR_PROFILE_SITES
+#define STR_PROFILE_SITES           0
+#endif
+
+// Number of distinct declaration sites StrSiteProfiler can track, sites past that are not recorded
+#ifndef STR_PROFILE_MAX_SITES
+#define STR_PROFILE_MAX_SITES       1024
+#endif
+
+// Number of independently locked shards of the StrInternPool table
+#ifndef STR_INTERN_SHARDS
+#define STR_INTERN_SHARDS           16
+#endif
+
+// Use SSE2 kernels for comparisons (on by default where SSE2 is always available, i.e. x86-64)
+#ifndef STR_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STR_SIMD                    1
+#else
+#define STR_SIMD                    0
+#endif
+#endif
+
+// Also use AVX2 kernels when the CPU supports them (checked at runtime unless compiling for AVX2 already)
+#ifndef STR_SIMD_AVX2
+#if STR_SIMD && (defined(__GNUC__) || defined(_MSC_VER))
+#define STR_SIMD_AVX2               1
+#else
+#define STR_SIMD_AVX2               0
+#endif
+#endif
+
+// Use POSIX I/O (writev) for StrBuilder::write(), StrIoVec and Str::map_file()
+#ifndef STR_POSIX
+#if defined(__unix__) || defined(__APPLE__)
+#define STR_POSIX                   1
+#else
+#define STR_POSIX                   0
+#endif
+#endif
+
+// StrBuilder: appends of at least this many bytes are referenced instead of copied
+#ifndef STR_BUILDER_REF_MIN_SIZE
+#define STR_BUILDER_REF_MIN_SIZE    256
+#endif
+
+// StrBuilder: size of the slabs small appends are copied into
+#ifndef STR_BUILDER_SLAB_SIZE
+#define STR_BUILDER_SLAB_SIZE       (16 * 1024)
+#endif
+
+// StrIoVec: number of iovec entries gathered per writev() batch
+#ifndef STR_IOVEC_BATCH
+#define STR_IOVEC_BATCH             256
+#endif
+
+// StrIoVec: pieces up to this size are copied into the scratch buffer (merging with their neighbors) instead of using an iovec entry each
+#ifndef STR_IOVEC_COALESCE_MAX_SIZE
+#define STR_IOVEC_COALESCE_MAX_SIZE 64
+#endif
+
+// StrIoVec: size of the scratch buffer small pieces are coalesced into
+#ifndef STR_IOVEC_SCRATCH_SIZE
+#define STR_IOVEC_SCRATCH_SIZE      2048
+#endif
+
 #include <string.h>   // for strlen, strcmp, memcpy, etc.
 #include <fmt/format.h>
+#include <fmt/compile.h>
 #include <string_view>
 #include <compare>
+#include <concepts>
+#include <type_traits>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <bit>
+#include <algorithm>
+#include <stdint.h>
+#include <new>
+#include <span>
+#include <iterator>
+#include <charconv>
+#if STR_POSIX
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#endif
+#if STR_SIMD
+#include <emmintrin.h>
+#endif
+#if STR_SIMD_AVX2
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+#if STR_PROFILE_SITES
+#include <source_location>
+#endif
 
 //-------------------------------------------------------------------------
 // HEADERS
 //-------------------------------------------------------------------------
 
+// How append(), appendf() and operator+= pick the new capacity when the buffer is too small.
+// reserve() and reserve_discard() are not affected and always allocate the exact capacity requested.
+enum StrGrowth
+{
+    StrGrowth_Default   = 0,    // 2x up to STR_GROWTH_THRESHOLD bytes of capacity, 1.5x after that
+    StrGrowth_Factor2   = 1,    // 2x
+    StrGrowth_Factor1_5 = 2,    // 1.5x
+    StrGrowth_Exact     = 3,    // Exact fit, every growing append reallocates (behavior of v0.40 and before)
+};
+
+// Allocator used by Str and StrN<N> unless another one is given to StrN<N, ALLOC>.
+// A custom allocator only needs the same two functions, and may be stateful (e.g. hold a pointer to a per-request arena).
+// Allocators that aren't empty can provide operator== to tell whether two instances can free each other's memory,
+// this is used to steal buffers on move. Without it, moving between them copies.
+// Allocators can also provide 'size_t good_size(size_t size) const', returning the usable size of an allocation of
+// 'size' bytes: the string capacity is rounded up to it, and the exact same size is given back to deallocate().
+struct StrDefaultAllocator
+{
+    void*   allocate(size_t size)                   { return STR_MEMALLOC(size); }
+    void    deallocate(void* ptr, size_t size)      { (void)size; STR_MEMFREE(ptr); }
+};
+
+// Type-erased access to the allocator of a StrN<N, ALLOC>, so the non-template Str code can use it
+struct StrAllocVTable
+{
+    void*   (*Alloc)(void* slot, size_t size);
+    void    (*Free)(void* slot, void* ptr, size_t size);
+    bool    (*Equal)(const void* slot_a, const void* slot_b);
+    size_t  (*GoodSize)(const void* slot, size_t size);
+};
+
+// Stored by StrN<N, ALLOC> right after its local buffer, for non-default allocators only
+template<typename ALLOC>
+struct StrAllocSlot
+{
+    const StrAllocVTable*   VTable;
+    ALLOC                   Allocator;
+
+    StrAllocSlot(const ALLOC& allocator) : VTable(&VTableInstance), Allocator(allocator) {}
+
+    static void*    Alloc(void* slot, size_t size)              { return ((StrAllocSlot*)slot)->Allocator.allocate(size); }
+    static void     Free(void* slot, void* ptr, size_t size)    { ((StrAllocSlot*)slot)->Allocator.deallocate(ptr, size); }
+    static bool     Equal(const void* slot_a, const void* slot_b)
+    {
+        const ALLOC& a = ((const StrAllocSlot*)slot_a)->Allocator;
+        const ALLOC& b = ((const StrAllocSlot*)slot_b)->Allocator;
+        if constexpr (requires { { a == b } -> std::convertible_to<bool>; })
+            return a == b;
+        else
+            return std::is_empty_v<ALLOC>;
+    }
+    static size_t   GoodSize(const void* slot, size_t size)
+    {
+        const ALLOC& a = ((const StrAllocSlot*)slot)->Allocator;
+        if constexpr (requires { { a.good_size(size) } -> std::convertible_to<size_t>; })
+            return a.good_size(size);
+        else
+            return size;
+    }
+    static constexpr StrAllocVTable VTableInstance = { Alloc, Free, Equal, GoodSize };
+};
+
+// While a StrArenaScope is alive, heap buffers of Str/StrN using the default allocator are bump-allocated from it on
+// the current thread, freeing them is a no-op, and everything is released at once when the scope ends.
+// Strings must not outlive the scope they allocated from (checked on free when STR_ARENA_CHECKS is enabled), this
+// includes longer-lived strings that grow while the scope is active.
+// Scopes can be nested, allocations go to the innermost one.
+class STR_API StrArenaScope
+{
+public:
+    explicit StrArenaScope(size_t chunk_size = STR_ARENA_CHUNK_SIZE);
+    ~StrArenaScope();
+    StrArenaScope(const StrArenaScope&) = delete;
+    StrArenaScope& operator=(const StrArenaScope&) = delete;
+
+    static StrArenaScope* get_current()                         { return Current; }
+    static bool         is_live(const void* ptr);               // Is 'ptr' owned by an active scope on this thread?
+    void*               alloc(size_t size);
+    bool                extend(void* ptr, size_t old_size, size_t new_size); // Grow the last allocation in place
+    bool                owns(const void* ptr) const;
+    size_t              bytes_allocated() const                 { return m_bytes_allocated; }
+
+private:
+    struct Chunk
+    {
+        Chunk*  Prev;
+        size_t  Size;               // Bytes following this header
+    };
+    Chunk*              m_chunk;    // Current chunk, linked to the previous ones
+    char*               m_ptr;      // Next free byte in m_chunk
+    char*               m_end;
+    char*               m_last;     // Last allocation, can be extended in place
+    size_t              m_chunk_size;
+    size_t              m_bytes_allocated;
+    StrArenaScope*      m_prev;     // Enclosing scope on this thread
+
+    static thread_local StrArenaScope* Current;
+};
+
+// Pool of heap buffers for strings, in size classes (16 bytes apart up to 128, then 4 classes per power of two, so at
+// most 25% slack) up to STR_POOL_MAX_SIZE. Each thread caches freed blocks in its own free lists, no locking involved.
+// Threads that free more than they allocate (e.g. consumers of strings built by other threads) hand batches of
+// STR_POOL_BATCH_SIZE blocks over to a global depot, where threads with empty lists pick them up.
+// Blocks are only given back to STR_MEMFREE by release_cached().
+// Use it with StrN<N, StrPoolAllocator>, or for all strings with the default allocator with STR_USE_POOL.
+class STR_API StrPool
+{
+public:
+    static void*        alloc(size_t size);
+    static void         dealloc(void* ptr, size_t size);            // 'size' must be the allocated size, i.e. good_size(requested size)
+    static size_t       good_size(size_t size);
+    static void         release_cached();                           // Free blocks cached by the calling thread and the depot
+
+    static constexpr int CLASS_COUNT = 8 + 4 * 16;                  // Enough to cover STR_POOL_MAX_SIZE up to 16MB
+    static int          size_to_class(size_t size);
+    static size_t       class_to_size(int size_class);
+
+private:
+    struct ThreadCache
+    {
+        void*   Head[CLASS_COUNT];                                  // Free lists, linked through the first word of each block
+        int     Count[CLASS_COUNT];
+        bool    Alive;
+        ThreadCache();
+        ~ThreadCache();
+    };
+    struct Depot
+    {
+        std::mutex Mutex;
+        std::atomic<void*> Batches[CLASS_COUNT];                    // Batches linked through the second word of their first block. Written under Mutex.
+    };
+    static ThreadCache& get_thread_cache();
+    static Depot&       get_depot();
+    static void         push_batch(int size_class, void* batch);
+    static void*        pop_batch(int size_class);
+};
+
+static_assert(STR_POOL_MAX_SIZE <= 16 * 1024 * 1024, "STR_POOL_MAX_SIZE is limited to 16MB");
+
+struct StrPoolAllocator
+{
+    void*   allocate(size_t size)                   { return StrPool::alloc(size); }
+    void    deallocate(void* ptr, size_t size)      { StrPool::dealloc(ptr, size); }
+    size_t  good_size(size_t size) const            { return StrPool::good_size(size); }
+};
+
+class Str;
+class StrSplit;
+
+// Counters kept by StrTelemetry
+enum StrTelemetryCounter
+{
+    StrTelemetryCounter_ReserveLocal,           // reserve()/reserve_discard() calls served by the local buffer
+    StrTelemetryCounter_ReserveHeap,            // reserve()/reserve_discard() calls served by the heap (current buffer, new or extended one)
+    StrTelemetryCounter_AllocCount,             // Heap buffers allocated, whatever the allocator
+    StrTelemetryCounter_AllocBytes,
+    StrTelemetryCounter_FreeCount,
+    StrTelemetryCounter_FreeBytes,
+    StrTelemetryCounter_CopyCount,              // reserve() moving existing contents to a new buffer
+    StrTelemetryCounter_CopyBytes,
+    StrTelemetryCounter_Spill,                  // Strings with a local buffer switching to the heap
+    StrTelemetryCounter_SpillByLocalSize,       // Spills by local buffer size: entry i counts local sizes in [2^i, 2^(i+1))
+    StrTelemetryCounter_COUNT = StrTelemetryCounter_SpillByLocalSize + 17
+};
+
+// Allocation telemetry, compiled in with STR_TELEMETRY. Each thread updates its own counters without synchronization,
+// get_global() sums them over all threads (counters of exited threads are kept). Snapshots can be polled at any time,
+// use get_counter_name() to export them. When disabled, snapshots are all zeroes.
+class STR_API StrTelemetry
+{
+public:
+    uint64_t            Counters[StrTelemetryCounter_COUNT];
+
+    StrTelemetry()                                              { memset(Counters, 0, sizeof(Counters)); }
+    static StrTelemetry get_thread();                           // Snapshot of the calling thread's counters
+    static StrTelemetry get_global();                           // Snapshot of all threads' counters
+    static const char*  get_counter_name(int counter);
+    static int          get_spill_counter(int local_size)       { return StrTelemetryCounter_SpillByLocalSize + (int)std::bit_width((unsigned)local_size) - 1; }
+    void                dump(Str* out) const;                   // Append one "name value" line per counter
+
+#if STR_TELEMETRY
+    static void         add(int counter, uint64_t value);
+
+private:
+    struct ThreadData
+    {
+        std::atomic<uint64_t> Counters[StrTelemetryCounter_COUNT]; // Only written by the owning thread
+        ThreadData*     Prev;
+        ThreadData*     Next;
+        bool            Alive;
+        ThreadData();
+        ~ThreadData();
+    };
+    struct Registry
+    {
+        std::mutex      Mutex;
+        ThreadData*     Threads = NULL;
+        uint64_t        Retired[StrTelemetryCounter_COUNT] = {}; // Counters of exited threads
+    };
+    static ThreadData&  get_thread_data();
+    static Registry&    get_registry();
+#endif
+};
+
+#if STR_TELEMETRY
+#define STR_TELEMETRY_ADD(_COUNTER, _VALUE)     StrTelemetry::add(_COUNTER, _VALUE)
+#else
+#define STR_TELEMETRY_ADD(_COUNTER, _VALUE)     ((void)0)
+#endif
+
+// Per declaration site statistics of StrN instances, compiled in with STR_PROFILE_SITES.
+// Every StrN constructor then captures its caller's std::source_location, and the destructor records the final size
+// and the peak capacity needed (largest size it had + 1 for the zero terminator) of the instance into the site's histograms.
+// report() lists sites with the smallest power of two local buffer that would have held 95% and 99% of instances.
+class STR_API StrSiteProfiler
+{
+public:
+    static const int    BUCKET_COUNT = 26;                          // Bucket 0 counts zeroes, bucket i counts values in [2^(i-1), 2^i)
+
+    struct Site
+    {
+        const char*     File;
+        const char*     Function;
+        int             Line;
+        int             Column;
+        int             LocalSize;
+        std::atomic<uint64_t> Count;                                // Instances destroyed
+        std::atomic<uint64_t> Spills;                               // Instances that needed more than their local buffer
+        std::atomic<uint64_t> MaxPeak;
+        std::atomic<uint64_t> SizeHistogram[BUCKET_COUNT];          // Final sizes
+        std::atomic<uint64_t> PeakHistogram[BUCKET_COUNT];          // Peak capacities needed
+
+        int             suggest_local_size(double fraction) const;  // Smallest power of two local size that would have held 'fraction' of instances
+    };
+
+    static int          get_bucket(uint64_t value)                  { int bucket = (int)std::bit_width(value); return bucket < BUCKET_COUNT ? bucket : BUCKET_COUNT - 1; }
+    static int          get_sites(Site** out_sites, int max_sites); // Sites seen so far, most instances first
+    static void         report(Str* out);                           // Append one line per site
+    static void         reset();                                    // Clear all counts (sites are kept)
+
+#if STR_PROFILE_SITES
+    static Site*        get_site(const std::source_location& location, int local_size);
+    static void         record(Site* site, size_t final_size, size_t peak);
+
+private:
+    static std::atomic<Site*> Sites[STR_PROFILE_MAX_SITES];        // Open addressing table, slots are only ever filled
+#endif
+};
+
+#if STR_PROFILE_SITES
+#define STR_SITE_ARG                const std::source_location& site = std::source_location::current()
+#define STR_SITE_ARG_NEXT           , STR_SITE_ARG
+#define STR_SITE_BEGIN()            m_site = StrSiteProfiler::get_site(site, LOCALBUFFSIZE)
+#define STR_SITE_END()              StrSiteProfiler::record(m_site, size(), m_profile_peak)
+#define STR_PROFILE_PEAK(_NEEDED)   profile_peak(_NEEDED)
+#else
+#define STR_SITE_ARG
+#define STR_SITE_ARG_NEXT
+#define STR_SITE_BEGIN()            ((void)0)
+#define STR_SITE_END()              ((void)0)
+#define STR_PROFILE_PEAK(_NEEDED)   ((void)0)
+#endif
+
+#if STR_SIMD_AVX2 && defined(__GNUC__)
+#define STR_TARGET_AVX2             __attribute__((target("avx2")))
+#else
+#define STR_TARGET_AVX2
+#endif
+
+// Set of bytes for find_first_of()/find_first_not_of(), build it once to search for the same set repeatedly.
+// Besides the bitmap it keeps the first 8 bytes (compared one by one with SSE2) and nibble tables for AVX2: byte b is
+// in the set when Low[b & 15] & High[b >> 4] != 0, which is exact while the bytes span at most 8 distinct high nibbles.
+class STR_API StrByteSet
+{
+public:
+    constexpr StrByteSet()                                          {}
+    constexpr StrByteSet(std::string_view bytes)                    { for (char c : bytes) add((unsigned char)c); }
+    constexpr void      add(unsigned char c)
+    {
+        if (contains(c))
+            return;
+        Bits[c >> 6] |= (uint64_t)1 << (c & 63);
+        if (Count < 8)
+            Bytes[Count] = (char)c;
+        Count++;
+        if (High[c >> 4] == 0 && HighNibbleCount++ < 8)
+            High[c >> 4] = (uint8_t)(1 << (HighNibbleCount - 1));
+        Low[c & 15] |= High[c >> 4];
+    }
+    constexpr bool      contains(unsigned char c) const             { return (Bits[c >> 6] >> (c & 63)) & 1; }
+    constexpr bool      is_nibble_exact() const                     { return HighNibbleCount <= 8; }
+
+    uint64_t            Bits[4] = {};
+    char                Bytes[8] = {};                              // First bytes added, all of them when Count <= 8
+    int                 Count = 0;                                  // Distinct bytes
+    int                 HighNibbleCount = 0;
+    uint8_t             Low[16] = {};
+    uint8_t             High[16] = {};                              // One bit per distinct high nibble
+};
+
+// Byte kernels used by Str. Comparisons and searches use SSE2 with STR_SIMD, plus AVX2 selected at runtime with
+// STR_SIMD_AVX2. Substring searches filter candidate positions on the first and last byte of the needle, a block at a
+// time, and only compare the middle of the candidates. The _slack variants are given how many bytes can be read at both pointers ('readable' >= n, e.g. the capacity of
+// two strings), which lets short inputs be compared with a single vector load instead of a loop over the tail.
+class STR_API StrSimd
+{
+public:
+    static inline bool  equal(const char* a, const char* b, size_t n);
+    static inline bool  equal_slack(const char* a, const char* b, size_t n, size_t readable);
+    static inline size_t mismatch(const char* a, const char* b, size_t n);                          // Index of the first differing byte, or n
+    static inline size_t mismatch_slack(const char* a, const char* b, size_t n, size_t readable);
+    static inline int   compare(const char* a, size_t a_len, const char* b, size_t b_len);            // <0, 0, >0 like memcmp, then shorter first
+    static inline int   compare_slack(const char* a, size_t a_len, const char* b, size_t b_len, size_t readable);
+    static inline uint64_t hash(const void* data, size_t len, uint64_t seed = 0);                    // 64-bit multiply-mix hash, not for cryptographic use
+    static inline size_t find_byte(const char* s, size_t n, char c);                                // Index of the first 'c', or npos
+    static inline size_t rfind_byte(const char* s, size_t n, char c);                               // Index of the last 'c', or npos
+    static inline size_t find(const char* s, size_t n, const char* needle, size_t needle_len);       // Index of the first occurrence, or npos
+    static inline size_t rfind(const char* s, size_t n, const char* needle, size_t needle_len);      // Index of the last occurrence, or npos
+    static inline size_t find_of(const char* s, size_t n, const StrByteSet& set, bool in_set);       // Index of the first byte in (or not in) 'set', or npos
+    static bool         has_avx2()                                  { return HasAvx2; }
+
+private:
+    static inline bool  equal_small(const char* a, const char* b, size_t n);                       // n < 16
+    static inline size_t mismatch_scalar(const char* a, const char* b, size_t n);
+#if STR_SIMD
+    static inline size_t mismatch_sse2(const char* a, const char* b, size_t n);                      // n >= 16
+    static inline size_t rfind_byte_sse2(const char* s, size_t n, char c);                          // n >= 16
+    static inline size_t find_sse2(const char* s, size_t n, const char* needle, size_t needle_len);  // needle_len >= 2, n - needle_len >= 15
+    static inline size_t rfind_sse2(const char* s, size_t n, const char* needle, size_t needle_len); // needle_len >= 2, n - needle_len >= 15
+    static inline size_t find_of_sse2(const char* s, size_t n, const StrByteSet& set, bool in_set);  // n >= 16, set.Count <= 8
+#endif
+#if STR_SIMD_AVX2
+    STR_TARGET_AVX2 static size_t mismatch_avx2(const char* a, const char* b, size_t n);             // n >= 32
+    STR_TARGET_AVX2 static size_t mismatch_avx2_slack(const char* a, const char* b, size_t n);       // n <= 32, 32 bytes readable
+    STR_TARGET_AVX2 static size_t find_avx2(const char* s, size_t n, const char* needle, size_t needle_len); // needle_len >= 2, n - needle_len >= 31
+    STR_TARGET_AVX2 static size_t find_of_avx2(const char* s, size_t n, const StrByteSet& set, bool in_set); // n >= 32, set.is_nibble_exact()
+    static bool         detect_avx2();
+#endif
+    static const bool   HasAvx2;
+};
+
+// Number to text kernels used by Str::append_int() and friends. Each writes at most BufferSize characters to 'out'
+// (no zero terminator) and returns how many. Integers are written two digits at a time from a table of digit pairs,
+// doubles use std::to_chars() for the shortest text that reads back to the same value.
+class STR_API StrNumber
+{
+public:
+    static constexpr int BufferSize = 24;                           // Longest output: "-2.2250738585072014e-308"
+    static inline int   format_uint(char* out, uint64_t v);
+    static inline int   format_int(char* out, int64_t v);
+    static inline int   format_hex(char* out, uint64_t v, bool upper = false); // No prefix
+    static inline int   format_double(char* out, double v);
+    static inline int   count_digits(uint64_t v);
+
+private:
+    static constexpr char DigitPairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+};
+
+// Process-wide table of deduplicated strings, used by Str::intern(). Interned strings are immutable and live until the
+// process exits, so equal strings interned anywhere share the same pointer. The table is split in STR_INTERN_SHARDS
+// shards picked by hash: looking up a string already interned doesn't lock, interning a new one locks its shard only.
+class STR_API StrInternPool
+{
+public:
+    struct Stats
+    {
+        int             Count;                                      // Distinct strings
+        size_t          Bytes;                                      // String storage, including headers and zero terminators
+        uint64_t        Lookups;                                    // intern() calls (other threads' last few calls may not be counted yet)
+        uint64_t        Hits;                                       // intern() calls that found the string already interned
+        double          get_hit_rate() const                        { return Lookups ? (double)Hits / (double)Lookups : 0.0; }
+    };
+
+    static std::string_view intern(std::string_view s);             // Zero terminated, valid until exit
+    static Stats        get_stats();
+
+private:
+    struct Entry
+    {
+        uint64_t        Hash;
+        uint32_t        Size;
+        const char*     get_data() const                            { return (const char*)(this + 1); }
+    };
+    struct Table
+    {
+        int             Capacity;                                   // Power of two
+        Table*          Prev;                                       // Smaller tables, kept for readers that may still be probing them
+        std::atomic<Entry*>* get_slots()                            { return (std::atomic<Entry*>*)(this + 1); }
+    };
+    struct alignas(64) Shard
+    {
+        std::atomic<Table*> Current;
+        std::mutex      Mutex;                                      // Held to insert, the fields below are protected by it
+        int             Count = 0;
+        size_t          Bytes = 0;
+        char*           ChunkPtr = NULL;                            // Storage for entries, allocated in chunks that are never freed
+        char*           ChunkEnd = NULL;
+    };
+    struct ThreadCounters                                           // Folded into the totals every 256 lookups and on thread exit, so that hits don't contend
+    {
+        uint64_t        Lookups = 0;
+        uint64_t        Hits = 0;
+        ~ThreadCounters()                                           { flush(); }
+        void            flush();
+    };
+    static std::atomic<uint64_t> TotalLookups;
+    static std::atomic<uint64_t> TotalHits;
+    static Shard*       get_shards();
+    static ThreadCounters& get_thread_counters();
+    static void         count_lookup(bool hit);
+    static const Entry* find(Table* table, std::string_view s, uint64_t hash);
+    static Table*       grow(Shard& shard);
+};
+
+// Header in front of the data of a shared heap buffer (see Str::make_shared). Shared buffers always come from
+// STR_MEMALLOC, whatever the allocator of the strings sharing them, or are file mappings (see Str::map_file).
+struct StrSharedHeader
+{
+    std::atomic<int>    RefCount;
+    int                 MapOffset;                                  // 0 for heap buffers. Mapped files: the mapping starts MapOffset bytes before the data.
+    size_t              Capacity;                                   // Bytes following the header
+};
+
+// Header in front of owned heap buffers of more than Str::SMALL_MAX bytes, whose capacity doesn't fit m_capacity
+struct StrLargeHeader
+{
+    size_t              Capacity;                                   // Bytes following the header
+    size_t              Padding;                                    // Keep the data 16 bytes aligned
+};
+
+// Format strings wrapped in FMT_COMPILE(): parsed at compile time into formatting code, see setf()/appendf()
+template<typename S>
+concept StrCompiledFormat = fmt::detail::is_compiled_string<S>::value;
+
 // This is the base class that you can pass around
 // Footprint is 16-bytes
+// With STR_SSO, a Str without local buffer keeps up to 14 characters in its first 15 bytes ("inline" mode): byte 14 holds
+// 14 - size and doubles as the terminator when full, the flags in byte 15 stay valid and m_owned + m_shared are both set
+// (a combination shared buffers, which are never owned, can't have).
 class STR_API Str
 {
 private:
     // TODO: there must be a better way to do this, right ?
-    char*   m_data;               // Point to LocalBuf() or heap allocated
-    unsigned int    m_size : 24;
-    unsigned int    m_local_size : 8;
-    unsigned int    m_capacity : 24;
-    unsigned int    m_owned : 1;  // Set when we have ownership of the pointed data (most common, unless using set_ref() method or StrRef constructor)
+    char*   m_data;               // Point to LocalBuf() or heap allocated. Overwritten by the characters in inline mode.
+    uint64_t        m_size : 24;  // Size, or its low 24 bits if m_large
+    uint64_t        m_capacity : 24;  // Capacity of an owned buffer (else the size), or the high 24 bits of the size if m_large
+    uint64_t        m_local_size : 9; // Encoded, see encode_local_size(). 0 but overwritten in inline mode: use get_local_size().
+    uint64_t        m_owned : 1;  // Set when we have ownership of the pointed data (most common, unless using set_ref() method or StrRef constructor)
+    uint64_t        m_growth : 2; // StrGrowth
+    uint64_t        m_alloc : 1;  // Set when a StrAllocSlot follows the local buffer (StrN with a custom allocator)
+    uint64_t        m_arena : 1;  // Set when the heap buffer comes from a StrArenaScope
+    uint64_t        m_shared : 1; // Set when m_data follows a StrSharedHeader. Shared buffers are read-only (m_owned is 0, m_capacity is m_size), writes detach first.
+    uint64_t        m_large : 1;  // Set when the size or capacity exceeds SMALL_MAX: see get_size(). An owned buffer then follows a StrLargeHeader.
+#if STR_PROFILE_SITES
+protected:
+    size_t          m_profile_peak = 0; // Largest capacity needed so far, for StrSiteProfiler (size_t to keep sizeof(Str) free of tail padding)
+#endif
 
 public:
-    inline char*        c_str()                                 { return m_data; }
-    inline std::string_view view() const                        { return static_cast<std::string_view>(*this); }
-    inline bool         empty() const                           { return m_size == 0; }
-    inline int          size() const                            { return m_size; }
-    inline int          capacity() const                        { return m_capacity; }
-    inline bool         owned() const                           { return m_owned ? true : false; }
+    constexpr char*     c_str()                                 { return get_data(); }
+    constexpr const char* c_str() const                         { return get_data(); }
+    inline size_t       hash() const                            { return (size_t)StrSimd::hash(get_data(), get_size()); }
+    constexpr std::string_view view() const                     { return static_cast<std::string_view>(*this); }
+    constexpr bool      empty() const                           { return get_size() == 0; }
+    constexpr size_t    size() const                            { return get_size(); }
+    constexpr size_t    capacity() const                        { return get_capacity(); }
+    constexpr bool      owned() const                           { return m_owned ? true : false; }
+    inline bool         is_shared() const                       { return m_shared && !m_owned; }
+    inline bool         is_mapped() const                       { return is_shared() && get_shared_header()->MapOffset != 0; } // Shared mapping of a file, see map_file()
+    inline int          shared_count() const                    { return is_shared() ? get_shared_header()->RefCount.load(std::memory_order_relaxed) : 0; } // Strings sharing the buffer
+    inline StrGrowth    growth() const                          { return (StrGrowth)m_growth; }
+    inline void         set_growth(StrGrowth growth)            { m_growth = growth; }
 
     inline void         set_ref(std::string_view s);
-    int                 append(std::string_view s);
-    int                 append_nogrow(std::string_view s);
+    void                set_shared(std::string_view s);         // Copy into a new shared buffer: copies of this string then share it until one of them is modified
+    void                make_shared()                           { if (!is_shared()) set_shared(view()); }
+#if STR_POSIX
+    bool                set_mapped_file(const char* path);      // Map a file read-only, shared like set_shared() (or read() it if it can't be mapped: pipes, /proc...). Returns false and sets errno on failure, leaving the string unchanged.
+#endif
+    ptrdiff_t           append(std::string_view s);
+    ptrdiff_t           append_nogrow(std::string_view s);
+    ptrdiff_t           append_int(int64_t v)                   { return append_number(true, [=](char* out) { return StrNumber::format_int(out, v); }); }
+    ptrdiff_t           append_uint(uint64_t v)                 { return append_number(true, [=](char* out) { return StrNumber::format_uint(out, v); }); }
+    ptrdiff_t           append_hex(uint64_t v, bool upper = false) { return append_number(true, [=](char* out) { return StrNumber::format_hex(out, v, upper); }); }
+    ptrdiff_t           append_double(double v)                 { return append_number(true, [=](char* out) { return StrNumber::format_double(out, v); }); } // Shortest round-trip
+    ptrdiff_t           append_int_nogrow(int64_t v)            { return append_number(false, [=](char* out) { return StrNumber::format_int(out, v); }); }
+    ptrdiff_t           append_uint_nogrow(uint64_t v)          { return append_number(false, [=](char* out) { return StrNumber::format_uint(out, v); }); }
+    ptrdiff_t           append_hex_nogrow(uint64_t v, bool upper = false) { return append_number(false, [=](char* out) { return StrNumber::format_hex(out, v, upper); }); }
+    ptrdiff_t           append_double_nogrow(double v)          { return append_number(false, [=](char* out) { return StrNumber::format_double(out, v); }); }
     
     template<typename... Args> int  setf(fmt::format_string<Args...> fm, Args&&... args);
     template<typename... Args> int  setf_nogrow(fmt::format_string<Args...> fm, Args&&... args);
     template<typename... Args> int  appendf(fmt::format_string<Args...> fm, Args&&... args);
     template<typename... Args> int  appendf_nogrow(fmt::format_string<Args...> fm, Args&&... args);
+    template<StrCompiledFormat S, typename... Args> int setf(const S& fm, Args&&... args)            { return format_compiled_at(0, true, fm, std::forward<Args>(args)...); }
+    template<StrCompiledFormat S, typename... Args> int setf_nogrow(const S& fm, Args&&... args)     { return format_compiled_at(0, false, fm, std::forward<Args>(args)...); }
+    template<StrCompiledFormat S, typename... Args> int appendf(const S& fm, Args&&... args)         { return format_compiled_at(get_size(), true, fm, std::forward<Args>(args)...); }
+    template<StrCompiledFormat S, typename... Args> int appendf_nogrow(const S& fm, Args&&... args)  { return format_compiled_at(get_size(), false, fm, std::forward<Args>(args)...); }
 
     void                clear();
-    void                reserve(int cap);
-    void                reserve_discard(int cap);
+    void                reserve(size_t cap);
+    void                reserve_discard(size_t cap);            // Contents are discarded
     void                shrink_to_fit();
 
-    inline char&        operator[](size_t i)                     { STR_ASSERT(-m_size < i && i < m_size); return m_data[i + (i < 0 ? m_size : 0)]; }
-    inline char         operator[](size_t i) const               { STR_ASSERT(-m_size < i && i < m_size); return m_data[i + (i < 0 ? m_size : 0)]; }
-    explicit operator   std::string_view() const                 { return std::string_view{m_data, m_size}; } // Don't know if we should keep this.
+    inline char&        operator[](ptrdiff_t i)                  { ptrdiff_t size = (ptrdiff_t)get_size(); STR_ASSERT(-size <= i && i < size); if (is_shared()) reserve(size + 1); return get_data()[i + (i < 0 ? size : 0)]; } // Negative indices count from the end
+    inline char         operator[](ptrdiff_t i) const            { ptrdiff_t size = (ptrdiff_t)get_size(); STR_ASSERT(-size <= i && i < size); return get_data()[i + (i < 0 ? size : 0)]; }
+    explicit constexpr operator std::string_view() const         { return std::string_view{get_data(), get_size()}; } // Don't know if we should keep this.
 
-    inline Str();
-    inline Str(std::string_view s)                               { m_local_size = 0; m_owned = 0; set(s); } // m_owned gets reset in call to set().
-    inline Str(const char* s)                                    { m_local_size = 0; m_owned = 0; set(s); }
+    constexpr Str();
+    inline Str(const Str& rhs);                                 // Deep copy. Copying a reference gives another reference.
+    inline Str(Str&& rhs) noexcept;                             // Steal heap buffer, copy used bytes out of a local buffer.
+    inline Str(std::string_view s)                               { m_local_size = 0; m_owned = 0; m_growth = STR_DEFAULT_GROWTH; m_alloc = 0; m_arena = 0; m_shared = 0; m_large = 0; set(s); } // m_owned gets reset in call to set().
+    inline Str(const char* s)                                    { m_local_size = 0; m_owned = 0; m_growth = STR_DEFAULT_GROWTH; m_alloc = 0; m_arena = 0; m_shared = 0; m_large = 0; set(s); }
     inline void         set(std::string_view src);
+    inline Str&         operator=(const Str& rhs);
+    inline Str&         operator=(Str&& rhs) noexcept;
     inline Str&         operator=(std::string_view rhs)          { set(rhs); return *this; }
+    inline Str&         operator=(const char* rhs)               { set(rhs); return *this; }
     inline Str&         operator+=(std::string_view rhs)         { append(rhs); return *this; }
-    inline bool         operator==(std::string_view rhs) const   { return view() == rhs; }
-    inline auto         operator<=>(std::string_view rhs) const  { return view() <=> rhs; }
+    inline bool         operator==(const Str& rhs) const        { size_t size = get_size(); const char* data = get_data(); const char* rhs_data = rhs.get_data(); return size == rhs.get_size() && (data == rhs_data || StrSimd::equal_slack(data, rhs_data, size, std::min(readable_size(), rhs.readable_size()))); }
+    inline bool         operator==(std::string_view rhs) const   { size_t size = get_size(); return size == rhs.size() && StrSimd::equal(get_data(), rhs.data(), size); }
+    inline bool         operator==(const char* rhs) const        { return *this == std::string_view(rhs); }
+    inline std::strong_ordering operator<=>(const Str& rhs) const { return StrSimd::compare_slack(get_data(), get_size(), rhs.get_data(), rhs.get_size(), std::min(readable_size(), rhs.readable_size())) <=> 0; }
+    inline std::strong_ordering operator<=>(std::string_view rhs) const { return StrSimd::compare(get_data(), get_size(), rhs.data(), rhs.size()) <=> 0; }
+    inline std::strong_ordering operator<=>(const char* rhs) const { return *this <=> std::string_view(rhs); }
+
+    // Searches (StrSimd kernels), with the same results as std::string_view: npos when not found
+    static constexpr size_t npos = std::string_view::npos;
+    inline size_t       find(char c, size_t pos = 0) const;
+    inline size_t       find(std::string_view s, size_t pos = 0) const;
+    inline size_t       rfind(char c, size_t pos = npos) const;
+    inline size_t       rfind(std::string_view s, size_t pos = npos) const;
+    inline size_t       find_first_of(const StrByteSet& set, size_t pos = 0) const;
+    inline size_t       find_first_not_of(const StrByteSet& set, size_t pos = 0) const;
+    size_t              find_first_of(std::string_view bytes, size_t pos = 0) const     { return find_first_of(StrByteSet(bytes), pos); }
+    size_t              find_first_not_of(std::string_view bytes, size_t pos = 0) const { return find_first_not_of(StrByteSet(bytes), pos); }
+    bool                contains(char c) const                  { return find(c) != npos; }
+    bool                contains(std::string_view s) const      { return find(s) != npos; }
+    bool                starts_with(std::string_view s) const   { return get_size() >= s.size() && StrSimd::equal(get_data(), s.data(), s.size()); }
+    bool                ends_with(std::string_view s) const     { size_t size = get_size(); return size >= s.size() && StrSimd::equal(get_data() + size - s.size(), s.data(), s.size()); }
+
+    // Lazy range of references to the pieces between delimiters, see StrSplit: for (Str field : line.split(','))
+    inline StrSplit     split(char delim, int flags = 0, int max_splits = -1) const;
+    inline StrSplit     split(std::string_view delim, int flags = 0, int max_splits = -1) const;
+    inline StrSplit     split(const StrByteSet& delims, int flags = 0, int max_splits = -1) const; // Any byte of the set
 
-    static inline Str   ref(std::string_view s);
+    static constexpr Str ref(std::string_view s)                { return Str(s.data(), s.size()); } // constexpr: usable to build constinit tables
+    static inline Str   shared(std::string_view s)              { Str tmp; tmp.set_shared(s); return tmp; }
+#if STR_POSIX
+    static inline Str   map_file(const char* path)              { Str tmp; tmp.set_mapped_file(path); return tmp; } // Empty on failure (check errno)
+    static ptrdiff_t    write_all(int fd, std::span<const Str* const> pieces); // Gathered write of all pieces (see StrIoVec). Returns the number of bytes written, or -1 (see errno)
+#endif
+    static inline Str   intern(std::string_view s)              { return ref(StrInternPool::intern(s)); } // Reference to the deduplicated copy in StrInternPool
 
     // Destructor for all variants
-    inline ~Str()
+    constexpr ~Str()
     {
-        if (m_owned && !is_using_local_buf())
-            STR_MEMFREE(m_data);
+        if (!std::is_constant_evaluated()) // Strings created during constant evaluation don't own a heap buffer
+            free_heap_buf();
     }
 
-    static char*        EmptyBuffer;
+    // Static empty buffer we can point to for empty strings
+    // Being read-only increases the like-hood of getting a crash if someone attempts to write in the empty string buffer.
+    static constexpr char EmptyBuffer[] = "\0NULL";
+    static constexpr size_t SMALL_MAX = 0xFFFFFF;               // Largest size and capacity held in m_size and m_capacity
+    static constexpr size_t INLINE_CAPACITY = STR_SSO ? 15 : 0; // Capacity (terminator included) of a plain Str in inline mode
+    static constexpr size_t LOCAL_SIZE_MAX = 65536;             // Largest local buffer of a StrN
+    static constexpr bool is_valid_local_size(size_t size)      { return size < 256 || (size % 256 == 0 && size <= LOCAL_SIZE_MAX); } // Sizes m_local_size can encode
 
 protected:
     inline char*        local_buf()                             { return (char*)this + sizeof(Str); }
     inline const char*  local_buf() const                       { return (char*)this + sizeof(Str); }
-    inline bool         is_using_local_buf() const              { return m_data == local_buf(); }
+    constexpr bool      is_inline() const                       { return STR_SSO && m_owned && m_shared; }
+    inline bool         is_using_local_buf() const              { return is_inline() || m_data == local_buf(); } // Inline storage is the local buffer of a plain Str
+    inline bool         can_use_inline(size_t capacity) const   { return STR_SSO && capacity <= INLINE_CAPACITY && get_local_size() == 0 && !m_alloc; }
+    static constexpr int encode_local_size(int size)            { return size < 256 ? size : 255 + (size >> 8); } // Exact below 256, in units of 256 above (9 bits up to LOCAL_SIZE_MAX)
+    static constexpr int decode_local_size(int code)            { return code < 256 ? code : (code - 255) << 8; }
+    constexpr int       get_local_size() const                  { return is_inline() ? 0 : decode_local_size((int)m_local_size); }
+    constexpr char*     get_data()                              { return is_inline() ? (char*)this : m_data; }
+    constexpr const char* get_data() const                      { return is_inline() ? (const char*)this : m_data; }
+    inline unsigned char& inline_tail()                         { return ((unsigned char*)this)[INLINE_CAPACITY - 1]; } // 14 - size in inline mode
+    inline unsigned char inline_tail() const                    { return ((const unsigned char*)this)[INLINE_CAPACITY - 1]; }
+    constexpr size_t    get_size() const                        { return is_inline() ? INLINE_CAPACITY - 1 - inline_tail() : m_large ? ((size_t)m_capacity << 24) | m_size : m_size; }
+    constexpr size_t    get_capacity() const                    { return !m_owned ? get_size() : is_inline() ? INLINE_CAPACITY : !m_large ? m_capacity : get_large_header()->Capacity; } // Only owned buffers are writable
+    constexpr void      set_size(size_t size)                   { if (is_inline()) { STR_ASSERT(size < INLINE_CAPACITY); inline_tail() = (unsigned char)(INLINE_CAPACITY - 1 - size); } else if (m_large) { m_size = size & SMALL_MAX; m_capacity = size >> 24; } else { STR_ASSERT(size <= SMALL_MAX); m_size = size; } }
+    constexpr void      clear_inline()                          { if (is_inline()) { m_shared = 0; m_local_size = 0; } } // Before pointing m_data elsewhere
+    inline StrLargeHeader* get_large_header() const             { return (StrLargeHeader*)m_data - 1; }
+    constexpr void      set_owned_buf(char* data, size_t capacity, size_t size, bool arena);
+    constexpr void      set_view_buf(const char* data, size_t size);
+    inline void         set_inline_buf(std::string_view contents);
+    inline size_t       readable_size() const                   { return get_capacity(); } // Bytes that can be read at m_data
+    inline void*        alloc_slot() const                      { return (char*)this + sizeof(Str) + ((get_local_size() + alignof(void*) - 1) & ~(alignof(void*) - 1)); }
+    inline bool         is_same_allocator(const Str& rhs) const;
+    inline void         steal_buf(Str& rhs);                    // Take over rhs's heap buffer (or its share of a shared one), leaving it empty. Allocators must match.
+    inline size_t       mem_good_size(size_t size) const;
+    inline char*        mem_alloc(size_t size, bool* out_arena);
+    inline void         mem_free(char* ptr, size_t size);
+    inline char*        alloc_heap_buf(size_t capacity, bool* out_arena); // mem_alloc() with a StrLargeHeader in front if capacity > SMALL_MAX
+    inline void         free_heap_buf()                         { if (m_owned && !is_using_local_buf()) { if (m_large) free_large_buf(); else mem_free(m_data, m_capacity); } else if (is_shared()) release_shared(); }
+    void                free_large_buf();
+    inline StrSharedHeader* get_shared_header() const           { return (StrSharedHeader*)m_data - 1; }
+    inline void         release_shared();
+    inline void         set_empty_buf();
+    inline void         grow(size_t needed_capacity);
+#if STR_TELEMETRY
+    inline void         telemetry_heap_reserve();
+#endif
+#if STR_PROFILE_SITES
+    inline void         profile_peak(size_t needed)             { if (needed > m_profile_peak) m_profile_peak = needed; }
+#endif
+    int                 vformat_at(size_t offset, bool can_grow, fmt::string_view fm, fmt::format_args args);
+    template<StrCompiledFormat S, typename... Args> int format_compiled_at(size_t offset, bool can_grow, const S& fm, Args&&... args);
+    template<typename FORMAT> ptrdiff_t append_number(bool can_grow, FORMAT&& format);
+
+    friend class StrFmtBuffer;
+
+    // Reference to data, see ref()
+    constexpr Str(const char* data, size_t size) : Str()        { set_view_buf(data, size); }
 
     // Constructor for StrXXX variants with local buffer
-    Str(int local_buf_size)
+    constexpr Str(int local_buf_size, StrGrowth growth, bool custom_alloc)
     {
-        STR_ASSERT(local_buf_size <= 256);
-        m_data = local_buf();
-        m_data[0] = '\0';
-        m_capacity = local_buf_size;
-        m_local_size = local_buf_size;
-        m_size = 0;
-        m_owned = 1;
+        STR_ASSERT(is_valid_local_size((size_t)local_buf_size));
+        m_local_size = encode_local_size(local_buf_size);
+        m_growth = growth;
+        m_alloc = custom_alloc;
+        m_owned = 0;
+        m_shared = 0;
+        if (std::is_constant_evaluated())
+            set_view_buf(EmptyBuffer, 0); // local_buf() can't be computed here: StrN points to its buffer once constructed
+        else
+            set_empty_buf();
     }
 };
 
-Str::Str()
+constexpr Str::Str()
 {
-    m_data = EmptyBuffer;      // Shared READ-ONLY initial buffer for 0 capacity
+    m_data = const_cast<char*>(EmptyBuffer); // Shared READ-ONLY initial buffer for 0 capacity
     m_capacity = 0;
     m_local_size = 0;
     m_size = 0;
     m_owned = 0;
+    m_growth = STR_DEFAULT_GROWTH;
+    m_alloc = 0;
+    m_arena = 0;
+    m_shared = 0;
+    m_large = 0;
 }
 
-void    Str::set(std::string_view src)
+bool    Str::is_same_allocator(const Str& rhs) const
 {
-    int buf_len = src.size() + 1;
-    reserve_discard(buf_len);
-    memcpy(m_data, src.data(), (size_t)buf_len);
-    m_owned = 1;
-    m_size = src.size();
+    if (!m_alloc || !rhs.m_alloc)
+        return m_alloc == rhs.m_alloc;
+    const StrAllocVTable* vtable = *(const StrAllocVTable**)alloc_slot();
+    return vtable == *(const StrAllocVTable**)rhs.alloc_slot() && vtable->Equal(alloc_slot(), rhs.alloc_slot());
 }
 
-inline void Str::set_ref(std::string_view s)
+// Capacity we'll actually get when allocating 'size' bytes
+size_t  Str::mem_good_size(size_t size) const
 {
-    if (m_owned && !is_using_local_buf())
-        STR_MEMFREE(m_data);
-    m_data = const_cast<char*>(s.data());
-    m_size = s.size();
-    m_capacity = s.size();
-    m_owned = 0;
+    if (size > SMALL_MAX)
+        return size; // Large buffers have a header in front, rounding the capacity alone wouldn't match the allocator's sizes
+    size_t good_size;
+    if (m_alloc)
+    {
+        const void* slot = alloc_slot();
+        good_size = (*(const StrAllocVTable* const*)slot)->GoodSize(slot, (size_t)size);
+    }
+    else if (StrArenaScope::get_current())
+        good_size = ((size_t)size + alignof(void*) - 1) & ~(alignof(void*) - 1);
+    else
+        good_size = STR_USE_POOL ? StrPool::good_size((size_t)size) : (size_t)size;
+    return good_size <= SMALL_MAX ? good_size : size; // Don't round up into needing a header
 }
 
-inline Str Str::ref(std::string_view s)
+// Allocate a heap buffer. The caller stores *out_arena into m_arena once it is done with the previous buffer.
+char*   Str::mem_alloc(size_t size, bool* out_arena)
 {
-    Str tmp;
-    tmp.set_ref(s);
-    return tmp;
+    *out_arena = false;
+    STR_TELEMETRY_ADD(StrTelemetryCounter_AllocCount, 1);
+    STR_TELEMETRY_ADD(StrTelemetryCounter_AllocBytes, (uint64_t)size);
+    if (m_alloc)
+    {
+        void* slot = alloc_slot();
+        return (char*)(*(const StrAllocVTable**)slot)->Alloc(slot, (size_t)size);
+    }
+    if (StrArenaScope* arena = StrArenaScope::get_current())
+    {
+        *out_arena = true;
+        return (char*)arena->alloc((size_t)size);
+    }
+#if STR_USE_POOL
+    return (char*)StrPool::alloc((size_t)size);
+#else
+    return (char*)STR_MEMALLOC((size_t)size);
+#endif
 }
 
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Warray-bounds"                  // warning: array subscript is outside array bounds of 'Str [1]' (trailing storage of StrN/StrAllocN on a plain Str)
+#endif
 
-template<size_t LOCALBUFFSIZE>
-class StrN : public Str
+void    Str::mem_free(char* ptr, size_t size)
 {
-private:
-    char m_local_buf[LOCALBUFFSIZE];
-public:
-    StrN() : Str(LOCALBUFFSIZE) {}
-    StrN(std::string_view s) : Str(LOCALBUFFSIZE) { set(s); }
-    StrN(const char* s) : Str(LOCALBUFFSIZE) { set(s); }
-    StrN& operator=(std::string_view s) { set(s); return *this; }
-    StrN& operator=(const char* s) { set(s); return *this; }
-};
-
-// Disable PVS-Studio warning V730: Not all members of a class are initialized inside the constructor (local_buf is not initialized and that is fine)
-// -V:STR_DEFINETYPE:730
+    STR_TELEMETRY_ADD(StrTelemetryCounter_FreeCount, 1);
+    STR_TELEMETRY_ADD(StrTelemetryCounter_FreeBytes, (uint64_t)size);
+    if (m_arena)
+    {
+#if STR_ARENA_CHECKS
+        STR_ASSERT(StrArenaScope::is_live(ptr) && "Str allocated from a StrArenaScope outlived it");
+#endif
+        return;
+    }
+    if (!m_alloc)
+    {
+#if STR_USE_POOL
+        StrPool::dealloc(ptr, (size_t)size);
+#else
+        (void)size;
+        STR_MEMFREE(ptr);
+#endif
+        return;
+    }
+    void* slot = alloc_slot();
+    (*(const StrAllocVTable**)slot)->Free(slot, ptr, (size_t)size);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+char*   Str::alloc_heap_buf(size_t capacity, bool* out_arena)
+{
+    if (capacity <= SMALL_MAX)
+        return mem_alloc(capacity, out_arena);
+    StrLargeHeader* header = (StrLargeHeader*)mem_alloc(sizeof(StrLargeHeader) + capacity, out_arena);
+    header->Capacity = capacity;
+    return (char*)(header + 1);
+}
+
+void    Str::free_large_buf()
+{
+    mem_free((char*)get_large_header(), sizeof(StrLargeHeader) + get_large_header()->Capacity);
+}
+
+// Point to a buffer we own: the local buffer, or a heap buffer from alloc_heap_buf() with this capacity. Doesn't free anything.
+constexpr void Str::set_owned_buf(char* data, size_t capacity, size_t size, bool arena)
+{
+    clear_inline();
+    m_data = data;
+    m_owned = 1;
+    m_shared = 0;
+    m_arena = arena;
+    m_large = capacity > SMALL_MAX;
+    if (!m_large)
+        m_capacity = capacity;
+    set_size(size);
+}
+
+// Point to data we don't own (reference or shared buffer). Doesn't free anything.
+constexpr void Str::set_view_buf(const char* data, size_t size)
+{
+    clear_inline();
+    m_data = const_cast<char*>(data);
+    m_owned = 0;
+    m_shared = 0;
+    m_arena = 0;
+    m_large = size > SMALL_MAX;
+    if (!m_large)
+        m_capacity = size;
+    set_size(size);
+}
+
+// Switch to inline mode and copy the contents there (which may point into our current buffer). Frees the current buffer.
+void    Str::set_inline_buf(std::string_view contents)
+{
+    STR_ASSERT(can_use_inline(contents.size() + 1));
+    char tmp[INLINE_CAPACITY];
+    STR_MEMCPY(tmp, contents.data(), contents.size());
+    free_heap_buf();
+    m_owned = 1;
+    m_arena = 0;
+    m_shared = 0;
+    m_large = 0;
+    m_shared = 1;                                  // With m_owned: inline
+    STR_MEMCPY((char*)this, tmp, contents.size()); // Over m_data, m_size, m_capacity and the low bits of m_local_size
+    ((char*)this)[contents.size()] = 0;
+    set_size(contents.size());
+}
+
+Str::Str(const Str& rhs) : Str()
+{
+    *this = rhs;
+}
+
+Str::Str(Str&& rhs) noexcept : Str()
+{
+    *this = std::move(rhs);
+}
+
+Str&    Str::operator=(const Str& rhs)
+{
+    if (this == &rhs)
+        return *this;
+    if (rhs.is_shared() && rhs.get_size() >= (size_t)get_local_size()) // Share the buffer, unless the local buffer can take the contents
+    {
+        rhs.get_shared_header()->RefCount.fetch_add(1, std::memory_order_relaxed);
+        free_heap_buf();
+        set_view_buf(rhs.m_data, rhs.get_size());
+        m_shared = 1;
+    }
+    else if (rhs.m_owned || rhs.m_shared)
+        set(rhs.view());
+    else
+        set_ref(rhs.view());
+    return *this;
+}
+
+Str&    Str::operator=(Str&& rhs) noexcept
+{
+    if (this == &rhs)
+        return *this;
+    if (!rhs.is_shared() && (!rhs.m_owned || rhs.is_using_local_buf() || !is_same_allocator(rhs)))
+        return *this = rhs;  // Nothing to steal (or we couldn't free it): copy the reference, or the used bytes
+
+    steal_buf(rhs);
+    return *this;
+}
+
+void    Str::steal_buf(Str& rhs)
+{
+    free_heap_buf();
+    clear_inline();
+    m_data = rhs.m_data;
+    m_size = rhs.m_size;
+    m_capacity = rhs.m_capacity;
+    m_owned = rhs.m_owned;
+    m_arena = rhs.m_arena;
+    m_shared = rhs.m_shared;
+    m_large = rhs.m_large;
+    rhs.set_empty_buf();
+}
+
+void    Str::set(std::string_view src)
+{
+    if (src.empty() && !m_owned)
+    {
+        // Avoid allocating for an empty string
+        free_heap_buf();
+        set_empty_buf();
+        return;
+    }
+    reserve_discard(src.size() + 1);
+    char* data = get_data();
+    STR_MEMCPY(data, src.data(), src.size());
+    data[src.size()] = 0;
+    set_size(src.size());
+    STR_PROFILE_PEAK(src.size() + 1);
+}
+
+inline void Str::set_ref(std::string_view s)
+{
+    free_heap_buf();
+    set_view_buf(s.data(), s.size());
+}
+
+inline void Str::release_shared()
+{
+    StrSharedHeader* header = get_shared_header();
+    if (header->RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+#if STR_POSIX
+        if (header->MapOffset != 0)
+        {
+            char* mapping = (char*)(header + 1) - header->MapOffset;
+            size_t mapping_size = header->MapOffset + header->Capacity;
+            header->~StrSharedHeader();
+            munmap(mapping, mapping_size);
+            m_shared = 0;
+            return;
+        }
+#endif
+        STR_TELEMETRY_ADD(StrTelemetryCounter_FreeCount, 1);
+        STR_TELEMETRY_ADD(StrTelemetryCounter_FreeBytes, (uint64_t)header->Capacity);
+        header->~StrSharedHeader();
+        STR_MEMFREE(header);
+    }
+    m_shared = 0;
+}
+
+
+// Storage following the Str header in StrN: local buffer, then the allocator slot for non-default allocators
+template<size_t LOCALBUFFSIZE, typename ALLOC>
+struct StrLocalStorage
+{
+    char                m_local_buf[LOCALBUFFSIZE];
+    StrAllocSlot<ALLOC> m_alloc_slot;
+    StrLocalStorage(const ALLOC& allocator) : m_alloc_slot(allocator) {}
+};
+
+template<size_t LOCALBUFFSIZE>
+struct StrLocalStorage<LOCALBUFFSIZE, StrDefaultAllocator>
+{
+    char                m_local_buf[LOCALBUFFSIZE];
+    constexpr StrLocalStorage(const StrDefaultAllocator&) {}
+};
+
+// No local buffer, heap only with a custom allocator
+template<typename ALLOC>
+struct StrLocalStorage<0, ALLOC>
+{
+    StrAllocSlot<ALLOC> m_alloc_slot;
+    StrLocalStorage(const ALLOC& allocator) : m_alloc_slot(allocator) {}
+};
+
+template<size_t LOCALBUFFSIZE, typename ALLOC = StrDefaultAllocator, StrGrowth GROWTH = STR_DEFAULT_GROWTH>
+class StrN : public Str
+{
+private:
+    static constexpr bool CUSTOM_ALLOC = !std::is_same_v<ALLOC, StrDefaultAllocator>;
+    static_assert(Str::is_valid_local_size(LOCALBUFFSIZE), "local buffer size must be below 256, or a multiple of 256 up to Str::LOCAL_SIZE_MAX (64 KiB)");
+    static_assert(alignof(StrAllocSlot<ALLOC>) == alignof(void*), "allocator alignment must not exceed pointer alignment");
+
+    StrLocalStorage<LOCALBUFFSIZE, ALLOC> m_storage;
+#if STR_PROFILE_SITES
+    StrSiteProfiler::Site* m_site;
+#endif
+    // Fill the local buffer during constant evaluation (constinit/constexpr StrN with the default allocator), where set() can't run
+    constexpr bool      init_constant(std::string_view s)
+    {
+        if constexpr (LOCALBUFFSIZE > 0 && !CUSTOM_ALLOC)
+        {
+            if (!std::is_constant_evaluated())
+                return false;
+            STR_ASSERT(s.size() < LOCALBUFFSIZE && "StrN: constant doesn't fit in the local buffer");
+            for (size_t i = 0; i < LOCALBUFFSIZE; i++) // All of it: constants can't hold indeterminate bytes
+                m_storage.m_local_buf[i] = i < s.size() ? s[i] : 0;
+            set_owned_buf(m_storage.m_local_buf, LOCALBUFFSIZE, s.size(), false);
+#if STR_PROFILE_SITES
+            m_site = NULL;
+#endif
+            return true;
+        }
+        return false;
+    }
+
+public:
+    constexpr StrN(STR_SITE_ARG) : Str(LOCALBUFFSIZE, GROWTH, CUSTOM_ALLOC), m_storage(ALLOC()) { if (!init_constant("")) { STR_SITE_BEGIN(); } }
+    explicit StrN(const ALLOC& alloc STR_SITE_ARG_NEXT) : Str(LOCALBUFFSIZE, GROWTH, CUSTOM_ALLOC), m_storage(alloc) { STR_SITE_BEGIN(); }
+    StrN(const StrN& s STR_SITE_ARG_NEXT) : Str(LOCALBUFFSIZE, GROWTH, CUSTOM_ALLOC), m_storage(s.get_allocator()) { STR_SITE_BEGIN(); Str::operator=(s); }
+    StrN(StrN&& s STR_SITE_ARG_NEXT) noexcept : Str(LOCALBUFFSIZE, GROWTH, CUSTOM_ALLOC), m_storage(s.get_allocator()) { STR_SITE_BEGIN(); Str::operator=(std::move(s)); }
+    StrN(const Str& s, const ALLOC& alloc = ALLOC() STR_SITE_ARG_NEXT) : Str(LOCALBUFFSIZE, GROWTH, CUSTOM_ALLOC), m_storage(alloc) { STR_SITE_BEGIN(); Str::operator=(s); }
+    StrN(Str&& s, const ALLOC& alloc = ALLOC() STR_SITE_ARG_NEXT) noexcept : Str(LOCALBUFFSIZE, GROWTH, CUSTOM_ALLOC), m_storage(alloc) { STR_SITE_BEGIN(); Str::operator=(std::move(s)); }
+    constexpr StrN(std::string_view s, const ALLOC& alloc = ALLOC() STR_SITE_ARG_NEXT) : Str(LOCALBUFFSIZE, GROWTH, CUSTOM_ALLOC), m_storage(alloc) { if (!init_constant(s)) { STR_SITE_BEGIN(); set(s); } }
+    constexpr StrN(const char* s, const ALLOC& alloc = ALLOC() STR_SITE_ARG_NEXT) : Str(LOCALBUFFSIZE, GROWTH, CUSTOM_ALLOC), m_storage(alloc) { if (!init_constant(s)) { STR_SITE_BEGIN(); set(s); } }
+    constexpr ~StrN() { if (std::is_constant_evaluated()) return; STR_SITE_END(); if constexpr (CUSTOM_ALLOC) clear(); } // Free while the allocator is still alive
+    ALLOC get_allocator() const { if constexpr (CUSTOM_ALLOC) return m_storage.m_alloc_slot.Allocator; else return ALLOC(); }
+    StrN& operator=(const StrN& s) { Str::operator=(s); return *this; }
+    StrN& operator=(StrN&& s) noexcept { Str::operator=(std::move(s)); return *this; }
+    StrN& operator=(const Str& s) { Str::operator=(s); return *this; }
+    StrN& operator=(Str&& s) noexcept { Str::operator=(std::move(s)); return *this; }
+    StrN& operator=(std::string_view s) { set(s); return *this; }
+    StrN& operator=(const char* s) { set(s); return *this; }
+};
+
+// Disable PVS-Studio warning V730: Not all members of a class are initialized inside the constructor (local_buf is not initialized and that is fine)
+// -V:STR_DEFINETYPE:730
 
 #ifdef __clang__
 #pragma clang diagnostic push
@@ -253,168 +1459,2556 @@ using Str256 = StrN<256>;
 #pragma clang diagnostic pop
 #endif
 
-//-------------------------------------------------------------------------
-// IMPLEMENTATION
-//-------------------------------------------------------------------------
+template<typename STR> class StrHashed;
+
+// Hash functor for Str, StrHashed, std::string_view and C strings, all hashing to the same value for the same contents.
+// Transparent: with std::equal_to<> as key_equal, unordered containers keyed by Str can be searched by std::string_view
+// without constructing a Str:
+//   std::unordered_map<Str, int, StrHash, std::equal_to<>> map;
+//   map.find(std::string_view("key"));
+struct StrHash
+{
+    using is_transparent = void;
+    size_t              operator()(const Str& s) const              { return s.hash(); }
+    size_t              operator()(std::string_view s) const        { return (size_t)StrSimd::hash(s.data(), s.size()); }
+    size_t              operator()(const char* s) const             { return (size_t)StrSimd::hash(s, strlen(s)); }
+    template<typename STR>
+    size_t              operator()(const StrHashed<STR>& s) const { return s.hash(); }
+};
+
+template<> struct std::hash<Str> : StrHash {};
+template<size_t LOCALBUFFSIZE, typename ALLOC, StrGrowth GROWTH> struct std::hash<StrN<LOCALBUFFSIZE, ALLOC, GROWTH>> : StrHash {};
+
+// A string that caches its hash, for keys that are hashed again and again (e.g. looked up in several maps).
+// Only mutable through its own functions, which invalidate the cached hash. Read access goes through str().
+template<typename STR = Str>
+class StrHashed
+{
+public:
+    StrHashed()                                                     { m_hash = StrHash()(std::string_view()); m_hash_valid = true; }
+    StrHashed(std::string_view s) : m_str(s)                        { m_hash = 0; m_hash_valid = false; }
+    StrHashed(const char* s) : m_str(s)                             { m_hash = 0; m_hash_valid = false; }
+    StrHashed(const StrHashed& rhs) = default;
+    StrHashed(StrHashed&& rhs) noexcept = default;
+    StrHashed&          operator=(const StrHashed& rhs) = default;
+    StrHashed&          operator=(StrHashed&& rhs) noexcept = default;
+
+    const STR&          str() const                                 { return m_str; }
+    std::string_view    view() const                                { return m_str.view(); }
+    const char*         c_str() const                               { return m_str.c_str(); }
+    size_t              size() const                                { return m_str.size(); }
+    bool                empty() const                               { return m_str.empty(); }
+    size_t              hash() const                                { if (!m_hash_valid) { m_hash = m_str.hash(); m_hash_valid = true; } return m_hash; }
+
+    void                set(std::string_view s)                     { m_hash_valid = false; m_str.set(s); }
+    void                set_ref(std::string_view s)                 { m_hash_valid = false; m_str.set_ref(s); }
+    ptrdiff_t           append(std::string_view s)                  { m_hash_valid = false; return m_str.append(s); }
+    ptrdiff_t           append_nogrow(std::string_view s)           { m_hash_valid = false; return m_str.append_nogrow(s); }
+    template<typename... Args> int setf(fmt::format_string<Args...> fm, Args&&... args)             { m_hash_valid = false; return m_str.setf(fm, std::forward<Args>(args)...); }
+    template<typename... Args> int setf_nogrow(fmt::format_string<Args...> fm, Args&&... args)      { m_hash_valid = false; return m_str.setf_nogrow(fm, std::forward<Args>(args)...); }
+    template<typename... Args> int appendf(fmt::format_string<Args...> fm, Args&&... args)          { m_hash_valid = false; return m_str.appendf(fm, std::forward<Args>(args)...); }
+    template<typename... Args> int appendf_nogrow(fmt::format_string<Args...> fm, Args&&... args)   { m_hash_valid = false; return m_str.appendf_nogrow(fm, std::forward<Args>(args)...); }
+    template<StrCompiledFormat S, typename... Args> int setf(const S& fm, Args&&... args)            { m_hash_valid = false; return m_str.setf(fm, std::forward<Args>(args)...); }
+    template<StrCompiledFormat S, typename... Args> int setf_nogrow(const S& fm, Args&&... args)     { m_hash_valid = false; return m_str.setf_nogrow(fm, std::forward<Args>(args)...); }
+    template<StrCompiledFormat S, typename... Args> int appendf(const S& fm, Args&&... args)         { m_hash_valid = false; return m_str.appendf(fm, std::forward<Args>(args)...); }
+    template<StrCompiledFormat S, typename... Args> int appendf_nogrow(const S& fm, Args&&... args)  { m_hash_valid = false; return m_str.appendf_nogrow(fm, std::forward<Args>(args)...); }
+    void                clear()                                     { m_hash_valid = false; m_str.clear(); }
+    void                reserve(size_t cap)                         { m_str.reserve(cap); }
+    StrHashed&          operator=(std::string_view s)               { set(s); return *this; }
+    StrHashed&          operator=(const char* s)                    { set(s); return *this; }
+    StrHashed&          operator+=(std::string_view s)              { append(s); return *this; }
+
+    bool                operator==(const StrHashed& rhs) const      { return (!m_hash_valid || !rhs.m_hash_valid || m_hash == rhs.m_hash) && m_str == rhs.m_str; }
+    bool                operator==(std::string_view rhs) const      { return m_str == rhs; }
+    auto                operator<=>(const StrHashed& rhs) const     { return m_str <=> rhs.m_str; }
+    auto                operator<=>(std::string_view rhs) const     { return m_str <=> rhs; }
+
+private:
+    STR                 m_str;
+    mutable size_t      m_hash;
+    mutable bool        m_hash_valid;
+};
+
+// Open addressing hash map from strings to VALUE, keys stored inline as StrN<KEY_LOCAL_SIZE> in the entry array.
+// With linear probing and entries of 64 bytes (the default: 32 bytes of key local buffer and an 8 bytes VALUE), looking
+// up a short key usually touches a single cache line. Longer keys still work, they live on the heap.
+// Keys are looked up by std::string_view. Pointers to values are invalidated by insertions and erasures.
+template<typename VALUE, size_t KEY_LOCAL_SIZE = 32>
+class StrHashMap
+{
+public:
+    struct Entry
+    {
+        uint32_t        Tag;                                        // 0 for an empty entry, else low 31 bits of the hash with the top bit set
+        StrN<KEY_LOCAL_SIZE> Key;
+        VALUE           Value;
+    };
+
+    StrHashMap()                                                    { m_entries = NULL; m_alloc = NULL; m_size = m_capacity = 0; }
+    StrHashMap(const StrHashMap&) = delete;
+    StrHashMap&         operator=(const StrHashMap&) = delete;
+    ~StrHashMap()                                                   { clear(); STR_MEMFREE(m_alloc); }
+
+    int                 size() const                                { return m_size; }
+    int                 capacity() const                            { return m_capacity; }
+    bool                empty() const                               { return m_size == 0; }
+
+    VALUE*              find(std::string_view key)                  { int idx = find_index(key, StrSimd::hash(key.data(), key.size())); return idx >= 0 ? &m_entries[idx].Value : NULL; }
+    const VALUE*        find(std::string_view key) const            { int idx = find_index(key, StrSimd::hash(key.data(), key.size())); return idx >= 0 ? &m_entries[idx].Value : NULL; }
+    bool                contains(std::string_view key) const        { return find(key) != NULL; }
+    bool                insert(std::string_view key, const VALUE& value); // Returns false (and leaves the value alone) if the key exists
+    VALUE&              operator[](std::string_view key);           // Inserts a default constructed value if needed
+    bool                erase(std::string_view key);
+    void                clear();
+    void                reserve(int count);
+
+    // Visit every entry (in no particular order): func(const Str& key, VALUE& value)
+    template<typename FUNC>
+    void                for_each(FUNC&& func)                       { for (int i = 0; i < m_capacity; i++) if (m_entries[i].Tag) func((const Str&)m_entries[i].Key, m_entries[i].Value); }
+
+private:
+    Entry*              m_entries;                                  // m_capacity entries, aligned on a cache line
+    void*               m_alloc;
+    int                 m_size;
+    int                 m_capacity;                                 // Power of two
+
+    static uint32_t     make_tag(uint64_t hash)                     { return (uint32_t)hash | 0x80000000u; }
+    int                 find_index(std::string_view key, uint64_t hash) const;
+    int                 insert_index(std::string_view key, uint64_t hash, bool* out_inserted);
+    void                rehash(int new_capacity);
+};
+
+// Collects the pieces of a large output and concatenates them once, instead of reallocating and copying the prefix
+// on every append. Appends smaller than STR_BUILDER_REF_MIN_SIZE are copied into slabs of STR_BUILDER_SLAB_SIZE bytes,
+// larger ones are only referenced: they must stay alive and unchanged until the builder is finished or written.
+//   StrBuilder b;
+//   b.append("<html>");
+//   b.append(body);                         // referenced
+//   b.appendf("<p>{}</p>", count);           // formatted into a slab
+//   Str page = b.finish();                   // one allocation of the exact size
+//   b.write(fd);                             // or no concatenation at all: writev() of the pieces
+class STR_API StrBuilder
+{
+public:
+    StrBuilder()                                                    { m_segments = NULL; m_segment_count = m_segment_capacity = 0; m_slab = NULL; m_slab_ptr = m_slab_end = NULL; m_size = 0; }
+    StrBuilder(const StrBuilder&) = delete;
+    StrBuilder&         operator=(const StrBuilder&) = delete;
+    ~StrBuilder()                                                   { clear(); }
+
+    size_t              size() const                                { return m_size; }
+    bool                empty() const                               { return m_size == 0; }
+    int                 segment_count() const                       { return m_segment_count; }
+
+    void                append(std::string_view s)                  { if (s.size() >= STR_BUILDER_REF_MIN_SIZE) append_ref(s); else append_copy(s); }
+    void                append_copy(std::string_view s);
+    void                append_ref(std::string_view s);             // 's' must outlive the builder's last finish()/write()
+    template<typename... Args> void appendf(fmt::format_string<Args...> fm, Args&&... args);
+    StrBuilder&         operator+=(std::string_view s)              { append(s); return *this; }
+
+    void                finish(Str* out) const;                     // Concatenate into 'out' (replacing its contents) with a single reserve
+    Str                 finish() const                              { Str out; finish(&out); return out; }
+#if STR_POSIX
+    ptrdiff_t           write(int fd) const;                        // writev() all pieces to 'fd'. Returns the number of bytes written, or -1 (see errno)
+#endif
+    void                clear();                                    // Free slabs and forget all pieces
+
+    // Visit every piece in order: func(std::string_view piece)
+    template<typename FUNC>
+    void                for_each_segment(FUNC&& func) const         { for (int i = 0; i < m_segment_count; i++) func(std::string_view(m_segments[i].Data, m_segments[i].Size)); }
+
+private:
+    struct Segment
+    {
+        const char*     Data;
+        size_t          Size;
+    };
+    struct Slab
+    {
+        Slab*           Prev;
+    };
+    Segment*            m_segments;
+    int                 m_segment_count;
+    int                 m_segment_capacity;
+    Slab*               m_slab;                                     // Current slab, linked to the previous ones
+    char*               m_slab_ptr;                                 // Next free byte in m_slab
+    char*               m_slab_end;
+    size_t              m_size;
+
+    void                push_segment(const char* data, size_t size);
+    void                new_slab(size_t min_size);
+    void                commit_slab(size_t size);                   // Add 'size' bytes written at m_slab_ptr as a piece
+
+    friend class StrBuilderFmtBuffer;
+};
+
+// Append-only buffer shared by many producer threads, e.g. to assemble log output. append() is lock-free: it reserves
+// its range with a compare-exchange on the size (refusing ranges past the end, so a failed append leaves no trace)
+// and copies into it without a lock, failing like append_nogrow() when it doesn't fit. There are two buffers of 'capacity' bytes: flush() makes the other one current, waits for the appends still copying into the
+// old one and hands its contents to a callback before emptying it, so producers keep appending during the flush.
+// Appends that land in a buffer just swapped out, after it was emptied, are flushed with it next time: lines from
+// different threads are not ordered.
+//   StrAppendBuffer log(1 << 20);
+//   log.append(line);                                      // any thread, -1 if full
+//   log.flush([&](std::string_view s) { fwrite(s.data(), 1, s.size(), f); });   // one flusher at a time
+class STR_API StrAppendBuffer
+{
+public:
+    explicit StrAppendBuffer(size_t capacity);
+    StrAppendBuffer(const StrAppendBuffer&) = delete;
+    StrAppendBuffer&    operator=(const StrAppendBuffer&) = delete;
+    ~StrAppendBuffer()                                              { STR_MEMFREE(m_buffers[0].Data); STR_MEMFREE(m_buffers[1].Data); }
+
+    size_t              capacity() const                            { return m_capacity; }
+    ptrdiff_t           append(std::string_view s);                 // Returns s.size(), or -1 if it doesn't fit in the current buffer
+    template<typename FUNC>
+    size_t              flush(FUNC&& func);                         // Call func(std::string_view) with the current contents. Returns their size
+
+private:
+    // State packs the bytes reserved (never more than the capacity), the Sealed flag set by flush() and the count of
+    // appends in progress.
+    static constexpr uint64_t ReservedMask = ((uint64_t)1 << 44) - 1;
+    static constexpr uint64_t Sealed = (uint64_t)1 << 47;
+    static constexpr uint64_t Writer = (uint64_t)1 << 48;
+    struct alignas(64) Buffer
+    {
+        std::atomic<uint64_t> State;
+        char*           Data;
+    };
+    Buffer              m_buffers[2];
+    alignas(64) std::atomic<int> m_current;
+    size_t              m_capacity;
+    std::mutex          m_flush_mutex;
+};
+
+// Flags for StrSplit
+enum StrSplitFlags_
+{
+    StrSplitFlags_None          = 0,
+    StrSplitFlags_SkipEmpty     = 1 << 0,   // Drop empty pieces (runs of delimiters act as one, no leading/trailing empty piece)
+};
+
+// Lazy split of a string, for range-for loops. Pieces are references into the source (see Str::ref()): nothing is
+// copied or allocated, the source must stay alive and unchanged while they are used. The delimiter is a char, a string
+// or any byte of a StrByteSet, searched with the StrSimd kernels. After 'max_splits' splits (-1: no limit) the last
+// piece holds the rest of the string. An empty string delimiter never matches.
+//   for (Str field : line.split(','))                                         // "a,,b" -> "a", "", "b"
+//   for (Str word : StrSplit(text, StrByteSet(" \t"), StrSplitFlags_SkipEmpty))
+//   StrSplit(line, '=', 0, 1)                                                  // "k=v=w" -> "k", "v=w"
+class STR_API StrSplit
+{
+public:
+    StrSplit(std::string_view s, char delim, int flags = 0, int max_splits = -1)                 : m_source(s), m_kind(Kind_Char), m_char(delim), m_flags(flags), m_max_splits(max_splits) {}
+    StrSplit(std::string_view s, std::string_view delim, int flags = 0, int max_splits = -1)     : m_source(s), m_kind(Kind_String), m_string(delim), m_flags(flags), m_max_splits(max_splits) {}
+    StrSplit(std::string_view s, const StrByteSet& delims, int flags = 0, int max_splits = -1)   : m_source(s), m_kind(Kind_ByteSet), m_set(delims), m_flags(flags), m_max_splits(max_splits) {}
+
+    class Iterator
+    {
+    public:
+        using value_type = Str;
+        using difference_type = ptrdiff_t;
+
+        Iterator()                                                  {}
+        explicit Iterator(const StrSplit* split) : m_split(split)   { advance(); }
+        Str             operator*() const                           { return Str::ref(m_piece); }
+        std::string_view view() const                               { return m_piece; }
+        Iterator&       operator++()                                { advance(); return *this; }
+        void            operator++(int)                             { advance(); }
+        bool            operator==(std::default_sentinel_t) const   { return m_at_end; }
+
+    private:
+        const StrSplit* m_split = NULL;
+        std::string_view m_piece;
+        size_t          m_pos = 0;                                  // Start of the rest of the source
+        int             m_splits = 0;
+        bool            m_last = false;                             // m_piece is the rest of the source
+        bool            m_at_end = true;
+
+        void            advance();
+    };
+
+    Iterator            begin() const                               { return Iterator(this); }
+    std::default_sentinel_t end() const                             { return std::default_sentinel; }
+
+private:
+    enum Kind { Kind_Char, Kind_String, Kind_ByteSet };
+    std::string_view    m_source;
+    Kind                m_kind;
+    char                m_char = 0;
+    std::string_view    m_string;
+    StrByteSet          m_set;
+    int                 m_flags;
+    int                 m_max_splits;
+
+    size_t              delim_size() const                          { return m_kind == Kind_String ? m_string.size() : 1; }
+    size_t              find_delim(size_t pos) const;               // Position of the next delimiter, or npos
+    size_t              skip_delims(size_t pos) const;              // Position past the delimiters starting at 'pos'
+};
+
+#if STR_POSIX
+// Write all of 'iov' to 'fd', retrying on partial writes and EINTR and splitting in IOV_MAX sized batches.
+// 'iov' entries are modified. Returns the number of bytes written, or -1 (see errno).
+STR_API ptrdiff_t       StrWriteAll(int fd, struct iovec* iov, int count);
+
+// Gathered writes of many pieces to a file descriptor, without concatenating them first. Pieces are referenced by
+// iovec entries, except the small ones (up to STR_IOVEC_COALESCE_MAX_SIZE bytes) which are copied into a scratch
+// buffer so that a run of them costs a single entry. Every STR_IOVEC_BATCH entries the batch is written with writev().
+// Referenced pieces must stay alive and unchanged until the next flush(). The first error stops all further writes.
+//   StrIoVec out(socket_fd);
+//   out.add(status_line);
+//   for (const Str& h : headers) { out.add(h); out.add("\r\n"); }
+//   out.add(body);
+//   if (out.flush() < 0) perror("write");
+class STR_API StrIoVec
+{
+public:
+    explicit StrIoVec(int fd)                                       { m_fd = fd; m_count = 0; m_scratch_size = 0; m_written = 0; }
+    StrIoVec(const StrIoVec&) = delete;
+    StrIoVec&           operator=(const StrIoVec&) = delete;
+
+    void                add(std::string_view s);
+    void                add(const Str& s)                           { add(s.view()); }
+    void                add(const char* s)                          { add(std::string_view(s)); }
+    ptrdiff_t           flush();                                    // Write all pending pieces. Returns the number of bytes written since construction, or -1 (see errno)
+    ptrdiff_t           written() const                             { return m_written; }
+
+private:
+    int                 m_fd;
+    int                 m_count;                                    // Pending entries in m_iov
+    int                 m_scratch_size;
+    ptrdiff_t           m_written;                                  // -1 after an error
+    struct iovec        m_iov[STR_IOVEC_BATCH];
+    char                m_scratch[STR_IOVEC_SCRATCH_SIZE];
+};
+#endif
+
+//-------------------------------------------------------------------------
+// IMPLEMENTATION
+//-------------------------------------------------------------------------
+
+#if STR_SIMD_AVX2
+const bool StrSimd::HasAvx2 = StrSimd::detect_avx2();
+#else
+const bool StrSimd::HasAvx2 = false;
+#endif
+
+// Two overlapping word loads cover 'n' in [sizeof(WORD), 2 * sizeof(WORD)]
+template<typename WORD>
+static inline size_t StrMismatchWords(const char* a, const char* b, size_t n)
+{
+    WORD wa, wb;
+    memcpy(&wa, a, sizeof(WORD));
+    memcpy(&wb, b, sizeof(WORD));
+    if (wa != wb)
+        return std::countr_zero((WORD)(wa ^ wb)) / 8;
+    memcpy(&wa, a + n - sizeof(WORD), sizeof(WORD));
+    memcpy(&wb, b + n - sizeof(WORD), sizeof(WORD));
+    if (wa != wb)
+        return n - sizeof(WORD) + std::countr_zero((WORD)(wa ^ wb)) / 8;
+    return n;
+}
+
+// Branchless apart from picking the load width
+bool    StrSimd::equal_small(const char* a, const char* b, size_t n)
+{
+    if (n >= 8)
+    {
+        uint64_t a0, b0, a1, b1;
+        memcpy(&a0, a, 8); memcpy(&a1, a + n - 8, 8);
+        memcpy(&b0, b, 8); memcpy(&b1, b + n - 8, 8);
+        return ((a0 ^ b0) | (a1 ^ b1)) == 0;
+    }
+    if (n >= 4)
+    {
+        uint32_t a0, b0, a1, b1;
+        memcpy(&a0, a, 4); memcpy(&a1, a + n - 4, 4);
+        memcpy(&b0, b, 4); memcpy(&b1, b + n - 4, 4);
+        return ((a0 ^ b0) | (a1 ^ b1)) == 0;
+    }
+    if (n == 0)
+        return true;
+    return ((a[0] ^ b[0]) | (a[n / 2] ^ b[n / 2]) | (a[n - 1] ^ b[n - 1])) == 0;
+}
+
+size_t  StrSimd::mismatch_scalar(const char* a, const char* b, size_t n)
+{
+    if constexpr (std::endian::native == std::endian::little)
+    {
+        if (n >= 8)
+        {
+            for (size_t i = 0; i + 16 < n; i += 8)
+            {
+                size_t pos = StrMismatchWords<uint64_t>(a + i, b + i, 8);
+                if (pos < 8)
+                    return i + pos;
+            }
+            size_t tail = n < 16 ? 0 : n - 16;
+            return tail + StrMismatchWords<uint64_t>(a + tail, b + tail, n - tail);
+        }
+        if (n >= 4)
+            return StrMismatchWords<uint32_t>(a, b, n);
+    }
+    for (size_t i = 0; i < n; i++)
+        if (a[i] != b[i])
+            return i;
+    return n;
+}
+
+#if STR_SIMD
+static inline unsigned int StrMismatchMask16(const char* a, const char* b) // Bit set for each differing byte
+{
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+    return (unsigned int)_mm_movemask_epi8(eq) ^ 0xFFFF;
+}
+
+size_t  StrSimd::mismatch_sse2(const char* a, const char* b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        // Two blocks per iteration, a single test when they are equal
+        __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)), _mm_loadu_si128((const __m128i*)(b + i + 16)));
+        if (_mm_movemask_epi8(_mm_and_si128(eq0, eq1)) != 0xFFFF)
+        {
+            unsigned int diff = (unsigned int)_mm_movemask_epi8(eq0) ^ 0xFFFF;
+            return diff ? i + std::countr_zero(diff) : i + 16 + std::countr_zero((unsigned int)_mm_movemask_epi8(eq1) ^ 0xFFFF);
+        }
+    }
+    if (i + 16 <= n)
+    {
+        if (unsigned int diff = StrMismatchMask16(a + i, b + i))
+            return i + std::countr_zero(diff);
+        i += 16;
+    }
+    if (i < n)
+    {
+        // Last block overlaps bytes already known to be equal
+        if (unsigned int diff = StrMismatchMask16(a + n - 16, b + n - 16))
+            return n - 16 + std::countr_zero(diff);
+    }
+    return n;
+}
+#endif
+
+#if STR_SIMD_AVX2
+STR_TARGET_AVX2 static inline unsigned int StrMismatchMask32(const char* a, const char* b)
+{
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)a), _mm256_loadu_si256((const __m256i*)b));
+    return ~(unsigned int)_mm256_movemask_epi8(eq);
+}
+
+size_t  StrSimd::mismatch_avx2(const char* a, const char* b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+    {
+        __m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i + 32)), _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+        if ((unsigned int)_mm256_movemask_epi8(_mm256_and_si256(eq0, eq1)) != 0xFFFFFFFF)
+        {
+            unsigned int diff = ~(unsigned int)_mm256_movemask_epi8(eq0);
+            return diff ? i + std::countr_zero(diff) : i + 32 + std::countr_zero(~(unsigned int)_mm256_movemask_epi8(eq1));
+        }
+    }
+    if (i + 32 <= n)
+    {
+        if (unsigned int diff = StrMismatchMask32(a + i, b + i))
+            return i + std::countr_zero(diff);
+        i += 32;
+    }
+    if (i < n)
+    {
+        if (unsigned int diff = StrMismatchMask32(a + n - 32, b + n - 32))
+            return n - 32 + std::countr_zero(diff);
+    }
+    return n;
+}
+
+size_t  StrSimd::mismatch_avx2_slack(const char* a, const char* b, size_t n)
+{
+    __m256i va = _mm256_loadu_si256((const __m256i*)a);
+    __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+    unsigned int diff = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+    if (n < 32)
+        diff &= (1u << n) - 1;
+    return diff ? std::countr_zero(diff) : n;
+}
+
+bool    StrSimd::detect_avx2()
+{
+#if defined(__AVX2__)
+    return true;
+#elif defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7)
+        return false;
+    __cpuid(regs, 1);
+    if ((regs[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6) // OSXSAVE, OS saves XMM and YMM state
+        return false;
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init(); // We may run before it in static initialization
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+size_t  StrSimd::mismatch(const char* a, const char* b, size_t n)
+{
+#if STR_SIMD
+    if (n >= 16)
+    {
+#if STR_SIMD_AVX2
+        if (n >= 32 && HasAvx2)
+            return mismatch_avx2(a, b, n);
+#endif
+        return mismatch_sse2(a, b, n);
+    }
+#endif
+    return mismatch_scalar(a, b, n);
+}
+
+size_t  StrSimd::mismatch_slack(const char* a, const char* b, size_t n, size_t readable)
+{
+#if STR_SIMD
+    if (n <= 16 && readable >= 16)
+    {
+        unsigned int diff = StrMismatchMask16(a, b) & ((1u << n) - 1);
+        return diff ? std::countr_zero(diff) : n;
+    }
+#if STR_SIMD_AVX2
+    if (n <= 32 && readable >= 32 && HasAvx2)
+        return mismatch_avx2_slack(a, b, n);
+#endif
+#endif
+    (void)readable;
+    return mismatch(a, b, n);
+}
+
+static inline uint64_t StrHashMix(uint64_t a, uint64_t b) // Full 64x64->128 multiply, folded
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    uint64_t hi;
+    uint64_t lo = _umul128(a, b, &hi);
+    return lo ^ hi;
+#else
+    uint64_t a_hi = a >> 32, a_lo = (uint32_t)a, b_hi = b >> 32, b_lo = (uint32_t)b;
+    uint64_t mid0 = a_hi * b_lo, mid1 = a_lo * b_hi, lo = a_lo * b_lo;
+    uint64_t carry = ((lo >> 32) + (uint32_t)mid0 + (uint32_t)mid1) >> 32;
+    return (lo + (mid0 << 32) + (mid1 << 32)) ^ (a_hi * b_hi + (mid0 >> 32) + (mid1 >> 32) + carry);
+#endif
+}
+
+static inline uint64_t StrHashRead8(const char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t StrHashRead4(const char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+// Multiply-mix hash in the style of wyhash: short inputs are read with a few overlapping loads, long ones 48 bytes at
+// a time in three independent lanes so that the multiplies overlap.
+uint64_t StrSimd::hash(const void* data, size_t len, uint64_t seed)
+{
+    const uint64_t K0 = 0xa0761d6478bd642full, K1 = 0xe7037ed1a0b428dbull, K2 = 0x8ebc6af09c88c6e3ull, K3 = 0x589965cc75374cc3ull;
+    const char* p = (const char*)data;
+    seed ^= StrHashMix(seed ^ K0, K1);
+    uint64_t a, b;
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            size_t mid = (len >> 3) << 2;
+            a = (StrHashRead4(p) << 32) | StrHashRead4(p + mid);
+            b = (StrHashRead4(p + len - 4) << 32) | StrHashRead4(p + len - 4 - mid);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)(uint8_t)p[0] << 16) | ((uint64_t)(uint8_t)p[len >> 1] << 8) | (uint8_t)p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t remaining = len;
+        if (remaining > 48)
+        {
+            uint64_t lane1 = seed, lane2 = seed;
+            do
+            {
+                seed = StrHashMix(StrHashRead8(p) ^ K1, StrHashRead8(p + 8) ^ seed);
+                lane1 = StrHashMix(StrHashRead8(p + 16) ^ K2, StrHashRead8(p + 24) ^ lane1);
+                lane2 = StrHashMix(StrHashRead8(p + 32) ^ K3, StrHashRead8(p + 40) ^ lane2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= lane1 ^ lane2;
+        }
+        while (remaining > 16)
+        {
+            seed = StrHashMix(StrHashRead8(p) ^ K1, StrHashRead8(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        a = StrHashRead8(p + remaining - 16);
+        b = StrHashRead8(p + remaining - 8);
+    }
+    a ^= K1;
+    b ^= seed;
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+#else
+    uint64_t folded = StrHashMix(a, b);
+    a ^= folded;
+    b ^= folded >> 1;
+#endif
+    return StrHashMix(a ^ K0 ^ len, b ^ K1);
+}
+
+bool    StrSimd::equal(const char* a, const char* b, size_t n)
+{
+    return n < 16 ? equal_small(a, b, n) : mismatch(a, b, n) == n;
+}
+
+bool    StrSimd::equal_slack(const char* a, const char* b, size_t n, size_t readable)
+{
+#if STR_SIMD
+    if (n <= 16 && readable >= 16)
+        return (StrMismatchMask16(a, b) & ((1u << n) - 1)) == 0;
+#endif
+    (void)readable;
+    return equal(a, b, n);
+}
+
+int     StrSimd::compare(const char* a, size_t a_len, const char* b, size_t b_len)
+{
+    size_t n = a_len < b_len ? a_len : b_len;
+    size_t i = mismatch(a, b, n);
+    if (i < n)
+        return (int)(unsigned char)a[i] - (int)(unsigned char)b[i];
+    return a_len < b_len ? -1 : a_len > b_len ? 1 : 0;
+}
+
+int     StrSimd::compare_slack(const char* a, size_t a_len, const char* b, size_t b_len, size_t readable)
+{
+    size_t n = a_len < b_len ? a_len : b_len;
+    size_t i = mismatch_slack(a, b, n, readable);
+    if (i < n)
+        return (int)(unsigned char)a[i] - (int)(unsigned char)b[i];
+    return a_len < b_len ? -1 : a_len > b_len ? 1 : 0;
+}
+
+// Searches. Blocks hold one bit per position, the last (first, backwards) block overlaps positions already searched.
+#if STR_SIMD
+static inline unsigned int StrByteMask16(const char* s, __m128i c) // Bit set for each byte equal to 'c'
+{
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)s), c));
+}
+
+size_t  StrSimd::rfind_byte_sse2(const char* s, size_t n, char c)
+{
+    __m128i vc = _mm_set1_epi8(c);
+    size_t end = n;
+    for (; end >= 16; end -= 16)
+        if (unsigned int mask = StrByteMask16(s + end - 16, vc))
+            return end - 16 + std::bit_width(mask) - 1;
+    if (end > 0)
+        if (unsigned int mask = StrByteMask16(s, vc))
+            return std::bit_width(mask) - 1;
+    return std::string_view::npos;
+}
+
+size_t  StrSimd::find_sse2(const char* s, size_t n, const char* needle, size_t needle_len)
+{
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t starts = n - needle_len + 1;
+    for (size_t i = 0; i < starts; )
+    {
+        size_t block = std::min(i, starts - 16);
+        unsigned int mask = StrByteMask16(s + block, first) & StrByteMask16(s + block + needle_len - 1, last);
+        mask &= ~0u << (i - block);
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t pos = block + std::countr_zero(mask);
+            if (equal(s + pos + 1, needle + 1, needle_len - 2))
+                return pos;
+        }
+        i = block + 16;
+    }
+    return std::string_view::npos;
+}
+
+size_t  StrSimd::rfind_sse2(const char* s, size_t n, const char* needle, size_t needle_len)
+{
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    for (size_t end = n - needle_len + 1; end > 0; )
+    {
+        size_t block = end >= 16 ? end - 16 : 0;
+        unsigned int mask = StrByteMask16(s + block, first) & StrByteMask16(s + block + needle_len - 1, last);
+        mask &= (1u << (end - block)) - 1;
+        while (mask != 0)
+        {
+            int bit = std::bit_width(mask) - 1;
+            if (equal(s + block + bit + 1, needle + 1, needle_len - 2))
+                return block + bit;
+            mask ^= 1u << bit;
+        }
+        end = block;
+    }
+    return std::string_view::npos;
+}
+
+size_t  StrSimd::find_of_sse2(const char* s, size_t n, const StrByteSet& set, bool in_set)
+{
+    __m128i bytes[8];
+    for (int k = 0; k < set.Count; k++)
+        bytes[k] = _mm_set1_epi8(set.Bytes[k]);
+    unsigned int flip = in_set ? 0 : 0xFFFF;
+    for (size_t i = 0; i < n; )
+    {
+        size_t block = std::min(i, n - 16);
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + block));
+        __m128i hits = _mm_setzero_si128();
+        for (int k = 0; k < set.Count; k++)
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(v, bytes[k]));
+        unsigned int mask = (((unsigned int)_mm_movemask_epi8(hits) ^ flip) & (~0u << (i - block)));
+        if (mask != 0)
+            return block + std::countr_zero(mask);
+        i = block + 16;
+    }
+    return std::string_view::npos;
+}
+#endif
+
+#if STR_SIMD_AVX2
+STR_TARGET_AVX2 static inline unsigned int StrByteMask32(const char* s, __m256i c)
+{
+    return (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)s), c));
+}
+
+size_t  StrSimd::find_avx2(const char* s, size_t n, const char* needle, size_t needle_len)
+{
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t starts = n - needle_len + 1;
+    for (size_t i = 0; i < starts; )
+    {
+        size_t block = std::min(i, starts - 32);
+        unsigned int mask = StrByteMask32(s + block, first) & StrByteMask32(s + block + needle_len - 1, last);
+        mask &= ~0u << (i - block);
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t pos = block + std::countr_zero(mask);
+            if (equal(s + pos + 1, needle + 1, needle_len - 2))
+                return pos;
+        }
+        i = block + 32;
+    }
+    return std::string_view::npos;
+}
+
+// Nibble table lookup: one shuffle per nibble gives the set bits of each byte's low and high nibbles
+size_t  StrSimd::find_of_avx2(const char* s, size_t n, const StrByteSet& set, bool in_set)
+{
+    __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)set.Low));
+    __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)set.High));
+    __m256i nibble = _mm256_set1_epi8(0x0F);
+    unsigned int flip = in_set ? ~0u : 0;
+    for (size_t i = 0; i < n; )
+    {
+        size_t block = std::min(i, n - 32);
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + block));
+        __m256i hits = _mm256_and_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(v, nibble)),
+                                        _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+        unsigned int outside = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hits, _mm256_setzero_si256()));
+        unsigned int mask = (outside ^ flip) & (~0u << (i - block));
+        if (mask != 0)
+            return block + std::countr_zero(mask);
+        i = block + 32;
+    }
+    return std::string_view::npos;
+}
+#endif
+
+// memchr() is already vectorized by the C libraries we care about
+size_t  StrSimd::find_byte(const char* s, size_t n, char c)
+{
+    const char* p = (const char*)memchr(s, c, n);
+    return p ? (size_t)(p - s) : std::string_view::npos;
+}
+
+size_t  StrSimd::rfind_byte(const char* s, size_t n, char c)
+{
+#if STR_SIMD
+    if (n >= 16)
+        return rfind_byte_sse2(s, n, c);
+#endif
+    for (size_t i = n; i > 0; i--)
+        if (s[i - 1] == c)
+            return i - 1;
+    return std::string_view::npos;
+}
+
+size_t  StrSimd::find(const char* s, size_t n, const char* needle, size_t needle_len)
+{
+    if (needle_len > n)
+        return std::string_view::npos;
+    if (needle_len <= 1)
+        return needle_len == 0 ? 0 : find_byte(s, n, needle[0]);
+    size_t starts = n - needle_len + 1;
+#if STR_SIMD
+    if (starts >= 16)
+    {
+#if STR_SIMD_AVX2
+        if (starts >= 32 && HasAvx2)
+            return find_avx2(s, n, needle, needle_len);
+#endif
+        return find_sse2(s, n, needle, needle_len);
+    }
+#endif
+    for (size_t i = 0; i < starts; i++)
+        if (s[i] == needle[0] && s[i + needle_len - 1] == needle[needle_len - 1] && equal(s + i + 1, needle + 1, needle_len - 2))
+            return i;
+    return std::string_view::npos;
+}
+
+size_t  StrSimd::rfind(const char* s, size_t n, const char* needle, size_t needle_len)
+{
+    if (needle_len > n)
+        return std::string_view::npos;
+    if (needle_len <= 1)
+        return needle_len == 0 ? n : rfind_byte(s, n, needle[0]);
+    size_t starts = n - needle_len + 1;
+#if STR_SIMD
+    if (starts >= 16)
+        return rfind_sse2(s, n, needle, needle_len);
+#endif
+    for (size_t i = starts; i > 0; i--)
+        if (s[i - 1] == needle[0] && s[i + needle_len - 2] == needle[needle_len - 1] && equal(s + i, needle + 1, needle_len - 2))
+            return i - 1;
+    return std::string_view::npos;
+}
+
+size_t  StrSimd::find_of(const char* s, size_t n, const StrByteSet& set, bool in_set)
+{
+#if STR_SIMD
+    if (n >= 16)
+    {
+#if STR_SIMD_AVX2
+        if (n >= 32 && HasAvx2 && set.is_nibble_exact())
+            return find_of_avx2(s, n, set, in_set);
+#endif
+        if (set.Count <= 8)
+            return find_of_sse2(s, n, set, in_set);
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+        if (set.contains((unsigned char)s[i]) == in_set)
+            return i;
+    return std::string_view::npos;
+}
+
+int     StrNumber::count_digits(uint64_t v)
+{
+    int n = 1;
+    for (;;)
+    {
+        if (v < 10)     return n;
+        if (v < 100)    return n + 1;
+        if (v < 1000)   return n + 2;
+        if (v < 10000)  return n + 3;
+        v /= 10000;
+        n += 4;
+    }
+}
+
+int     StrNumber::format_uint(char* out, uint64_t v)
+{
+    int len = count_digits(v);
+    char* p = out + len;
+    while (v >= 100)
+    {
+        size_t pair = (size_t)(v % 100) * 2;
+        v /= 100;
+        p -= 2;
+        memcpy(p, DigitPairs + pair, 2);
+    }
+    if (v >= 10)
+        memcpy(p - 2, DigitPairs + v * 2, 2);
+    else
+        p[-1] = (char)('0' + v);
+    return len;
+}
+
+int     StrNumber::format_int(char* out, int64_t v)
+{
+    if (v >= 0)
+        return format_uint(out, (uint64_t)v);
+    *out = '-';
+    return 1 + format_uint(out + 1, 0 - (uint64_t)v);
+}
+
+int     StrNumber::format_hex(char* out, uint64_t v, bool upper)
+{
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    int len = (std::bit_width(v | 1) + 3) / 4;
+    for (char* p = out + len - 1; p >= out; p--, v >>= 4)
+        *p = digits[v & 15];
+    return len;
+}
+
+int     StrNumber::format_double(char* out, double v)
+{
+    std::to_chars_result r = std::to_chars(out, out + BufferSize, v);
+    STR_ASSERT(r.ec == std::errc());
+    return (int)(r.ptr - out);
+}
+
+thread_local StrArenaScope* StrArenaScope::Current = NULL;
+
+const char* StrTelemetry::get_counter_name(int counter)
+{
+    static const char* names[StrTelemetryCounter_COUNT] =
+    {
+        "reserve_local", "reserve_heap", "alloc_count", "alloc_bytes",
+        "free_count", "free_bytes", "copy_count", "copy_bytes",
+        "spill",
+        "spill_local_1", "spill_local_2_3", "spill_local_4_7", "spill_local_8_15",
+        "spill_local_16_31", "spill_local_32_63", "spill_local_64_127", "spill_local_128_255",
+        "spill_local_256_511", "spill_local_512_1023", "spill_local_1024_2047", "spill_local_2048_4095",
+        "spill_local_4096_8191", "spill_local_8192_16383", "spill_local_16384_32767", "spill_local_32768_65535",
+        "spill_local_65536_131071",
+    };
+    return (counter >= 0 && counter < StrTelemetryCounter_COUNT) ? names[counter] : NULL;
+}
+
+void    StrTelemetry::dump(Str* out) const
+{
+    for (int counter = 0; counter < StrTelemetryCounter_COUNT; counter++)
+        out->appendf("{} {}\n", get_counter_name(counter), Counters[counter]);
+}
+
+#if STR_TELEMETRY
+StrTelemetry::ThreadData::ThreadData()
+{
+    for (std::atomic<uint64_t>& counter : Counters)
+        counter.store(0, std::memory_order_relaxed);
+    Registry& registry = get_registry();
+    std::lock_guard<std::mutex> lock(registry.Mutex);
+    Prev = NULL;
+    Next = registry.Threads;
+    if (Next)
+        Next->Prev = this;
+    registry.Threads = this;
+    Alive = true;
+}
+
+StrTelemetry::ThreadData::~ThreadData()
+{
+    // Keep the counts. Strings destroyed after this (e.g. other thread_local objects) count straight into Retired.
+    Registry& registry = get_registry();
+    std::lock_guard<std::mutex> lock(registry.Mutex);
+    for (int counter = 0; counter < StrTelemetryCounter_COUNT; counter++)
+        registry.Retired[counter] += Counters[counter].load(std::memory_order_relaxed);
+    if (Prev)
+        Prev->Next = Next;
+    else
+        registry.Threads = Next;
+    if (Next)
+        Next->Prev = Prev;
+    Alive = false;
+}
+
+StrTelemetry::ThreadData& StrTelemetry::get_thread_data()
+{
+    static thread_local ThreadData data;
+    return data;
+}
+
+StrTelemetry::Registry& StrTelemetry::get_registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+void    StrTelemetry::add(int counter, uint64_t value)
+{
+    ThreadData& data = get_thread_data();
+    if (!data.Alive)
+    {
+        Registry& registry = get_registry();
+        std::lock_guard<std::mutex> lock(registry.Mutex);
+        registry.Retired[counter] += value;
+        return;
+    }
+    // Single writer: no need for an atomic read-modify-write, the atomic only makes get_global() reads well-defined
+    data.Counters[counter].store(data.Counters[counter].load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+#endif
+
+StrTelemetry StrTelemetry::get_thread()
+{
+    StrTelemetry snapshot;
+#if STR_TELEMETRY
+    ThreadData& data = get_thread_data();
+    for (int counter = 0; counter < StrTelemetryCounter_COUNT; counter++)
+        snapshot.Counters[counter] = data.Counters[counter].load(std::memory_order_relaxed);
+#endif
+    return snapshot;
+}
+
+StrTelemetry StrTelemetry::get_global()
+{
+    StrTelemetry snapshot;
+#if STR_TELEMETRY
+    Registry& registry = get_registry();
+    std::lock_guard<std::mutex> lock(registry.Mutex);
+    for (int counter = 0; counter < StrTelemetryCounter_COUNT; counter++)
+        snapshot.Counters[counter] = registry.Retired[counter];
+    for (ThreadData* data = registry.Threads; data != NULL; data = data->Next)
+        for (int counter = 0; counter < StrTelemetryCounter_COUNT; counter++)
+            snapshot.Counters[counter] += data->Counters[counter].load(std::memory_order_relaxed);
+#endif
+    return snapshot;
+}
+
+int     StrSiteProfiler::Site::suggest_local_size(double fraction) const
+{
+    uint64_t count = 0;
+    for (const std::atomic<uint64_t>& bucket : PeakHistogram)
+        count += bucket.load(std::memory_order_relaxed);
+    uint64_t covered = 0;
+    for (int bucket = 0; bucket < BUCKET_COUNT; bucket++)
+    {
+        covered += PeakHistogram[bucket].load(std::memory_order_relaxed);
+        if (covered >= fraction * count)
+            return 1 << bucket; // Peaks in bucket are < 2^bucket
+    }
+    return 1 << (BUCKET_COUNT - 1);
+}
+
+#if STR_PROFILE_SITES
+std::atomic<StrSiteProfiler::Site*> StrSiteProfiler::Sites[STR_PROFILE_MAX_SITES];
+
+StrSiteProfiler::Site* StrSiteProfiler::get_site(const std::source_location& location, int local_size)
+{
+    // The same file may have different name pointers in different translation units: hash and compare contents
+    uint32_t hash = 2166136261u;
+    for (const char* p = location.file_name(); *p; p++)
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    hash = (hash ^ location.line()) * 16777619u;
+    hash = (hash ^ location.column()) * 16777619u;
+    hash = (hash ^ (uint32_t)local_size) * 16777619u;
+
+    Site* new_site = NULL;
+    for (int probe = 0; probe < STR_PROFILE_MAX_SITES; probe++)
+    {
+        std::atomic<Site*>& slot = Sites[(hash + probe) % STR_PROFILE_MAX_SITES];
+        Site* site = slot.load(std::memory_order_acquire);
+        if (site == NULL)
+        {
+            if (new_site == NULL)
+            {
+                new_site = new (STR_MEMALLOC(sizeof(Site))) Site();
+                new_site->File = location.file_name();
+                new_site->Function = location.function_name();
+                new_site->Line = (int)location.line();
+                new_site->Column = (int)location.column();
+                new_site->LocalSize = local_size;
+            }
+            if (slot.compare_exchange_strong(site, new_site, std::memory_order_acq_rel))
+                return new_site;
+            // Lost the race for this slot, 'site' now holds the winner
+        }
+        if (site->Line == (int)location.line() && site->Column == (int)location.column() && site->LocalSize == local_size && strcmp(site->File, location.file_name()) == 0)
+        {
+            if (new_site)
+                STR_MEMFREE(new_site);
+            return site;
+        }
+    }
+    if (new_site)
+        STR_MEMFREE(new_site);
+    return NULL; // Table is full
+}
+
+void    StrSiteProfiler::record(Site* site, size_t final_size, size_t peak)
+{
+    if (site == NULL)
+        return;
+    site->Count.fetch_add(1, std::memory_order_relaxed);
+    if (peak > (size_t)site->LocalSize)
+        site->Spills.fetch_add(1, std::memory_order_relaxed);
+    uint64_t max_peak = site->MaxPeak.load(std::memory_order_relaxed);
+    while (peak > max_peak && !site->MaxPeak.compare_exchange_weak(max_peak, peak, std::memory_order_relaxed)) {}
+    site->SizeHistogram[get_bucket((uint64_t)final_size)].fetch_add(1, std::memory_order_relaxed);
+    site->PeakHistogram[get_bucket(peak)].fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+int     StrSiteProfiler::get_sites(Site** out_sites, int max_sites)
+{
+    int count = 0;
+#if STR_PROFILE_SITES
+    for (std::atomic<Site*>& slot : Sites)
+        if (Site* site = slot.load(std::memory_order_acquire))
+            if (count < max_sites)
+                out_sites[count++] = site;
+    qsort(out_sites, (size_t)count, sizeof(Site*), [](const void* lhs, const void* rhs)
+    {
+        uint64_t lhs_count = (*(Site* const*)lhs)->Count.load(std::memory_order_relaxed);
+        uint64_t rhs_count = (*(Site* const*)rhs)->Count.load(std::memory_order_relaxed);
+        return lhs_count > rhs_count ? -1 : lhs_count < rhs_count ? 1 : 0;
+    });
+#else
+    (void)out_sites;
+    (void)max_sites;
+#endif
+    return count;
+}
+
+void    StrSiteProfiler::report(Str* out)
+{
+#if STR_PROFILE_SITES
+    Site* sites[STR_PROFILE_MAX_SITES];
+    int count = get_sites(sites, STR_PROFILE_MAX_SITES);
+    for (int n = 0; n < count; n++)
+    {
+        const Site* site = sites[n];
+        uint64_t instances = site->Count.load(std::memory_order_relaxed);
+        if (instances == 0)
+            continue;
+        out->appendf("{}:{}:{} {} StrN<{}> count={} spills={:.1f}% max_peak={} suggest p95=StrN<{}> p99=StrN<{}>\n",
+            site->File, site->Line, site->Column, site->Function, site->LocalSize, instances,
+            100.0 * site->Spills.load(std::memory_order_relaxed) / instances, site->MaxPeak.load(std::memory_order_relaxed),
+            site->suggest_local_size(0.95), site->suggest_local_size(0.99));
+    }
+#else
+    out->append("StrSiteProfiler: compiled without STR_PROFILE_SITES\n");
+#endif
+}
+
+void    StrSiteProfiler::reset()
+{
+#if STR_PROFILE_SITES
+    for (std::atomic<Site*>& slot : Sites)
+        if (Site* site = slot.load(std::memory_order_acquire))
+        {
+            site->Count.store(0, std::memory_order_relaxed);
+            site->Spills.store(0, std::memory_order_relaxed);
+            site->MaxPeak.store(0, std::memory_order_relaxed);
+            for (int bucket = 0; bucket < BUCKET_COUNT; bucket++)
+            {
+                site->SizeHistogram[bucket].store(0, std::memory_order_relaxed);
+                site->PeakHistogram[bucket].store(0, std::memory_order_relaxed);
+            }
+        }
+#endif
+}
+
+StrArenaScope::StrArenaScope(size_t chunk_size)
+{
+    m_chunk = NULL;
+    m_ptr = m_end = m_last = NULL;
+    m_chunk_size = chunk_size;
+    m_bytes_allocated = 0;
+    m_prev = Current;
+    Current = this;
+}
+
+StrArenaScope::~StrArenaScope()
+{
+    STR_ASSERT(Current == this && "StrArenaScope destroyed out of order");
+    Current = m_prev;
+    while (Chunk* chunk = m_chunk)
+    {
+        m_chunk = chunk->Prev;
+        STR_MEMFREE(chunk);
+    }
+}
+
+void*   StrArenaScope::alloc(size_t size)
+{
+    size = (size + alignof(void*) - 1) & ~(alignof(void*) - 1);
+    if ((size_t)(m_end - m_ptr) < size)
+    {
+        // New chunk, oversized allocations get a chunk of their own
+        size_t chunk_size = size > m_chunk_size ? size : m_chunk_size;
+        Chunk* chunk = (Chunk*)STR_MEMALLOC(sizeof(Chunk) + chunk_size);
+        chunk->Prev = m_chunk;
+        chunk->Size = chunk_size;
+        m_chunk = chunk;
+        m_ptr = (char*)(chunk + 1);
+        m_end = m_ptr + chunk_size;
+    }
+    m_last = m_ptr;
+    m_ptr += size;
+    m_bytes_allocated += size;
+    return m_last;
+}
+
+bool    StrArenaScope::extend(void* ptr, size_t old_size, size_t new_size)
+{
+    old_size = (old_size + alignof(void*) - 1) & ~(alignof(void*) - 1);
+    new_size = (new_size + alignof(void*) - 1) & ~(alignof(void*) - 1);
+    if (ptr != m_last || m_last + old_size != m_ptr || (size_t)(m_end - m_last) < new_size)
+        return false;
+    m_ptr = m_last + new_size;
+    m_bytes_allocated += new_size - old_size;
+    return true;
+}
+
+bool    StrArenaScope::owns(const void* ptr) const
+{
+    for (Chunk* chunk = m_chunk; chunk != NULL; chunk = chunk->Prev)
+        if (ptr >= (const void*)(chunk + 1) && ptr < (const void*)((char*)(chunk + 1) + chunk->Size))
+            return true;
+    return false;
+}
+
+bool    StrArenaScope::is_live(const void* ptr)
+{
+    for (StrArenaScope* scope = Current; scope != NULL; scope = scope->m_prev)
+        if (scope->owns(ptr))
+            return true;
+    return false;
+}
+
+int     StrPool::size_to_class(size_t size)
+{
+    if (size <= 128)
+        return size <= 16 ? 0 : (int)((size + 15) >> 4) - 1;
+    int log2 = (int)std::bit_width(size - 1) - 1; // 2^log2 < size <= 2^(log2+1)
+    return 8 + (log2 - 7) * 4 + (int)(((size - 1) >> (log2 - 2)) & 3);
+}
+
+size_t  StrPool::class_to_size(int size_class)
+{
+    if (size_class < 8)
+        return (size_t)(size_class + 1) << 4;
+    int log2 = 7 + (size_class - 8) / 4;
+    return ((size_t)1 << log2) + ((size_t)((size_class - 8) % 4 + 1) << (log2 - 2));
+}
+
+size_t  StrPool::good_size(size_t size)
+{
+    return size <= STR_POOL_MAX_SIZE ? class_to_size(size_to_class(size)) : size;
+}
+
+StrPool::ThreadCache::ThreadCache()
+{
+    memset(Head, 0, sizeof(Head));
+    memset(Count, 0, sizeof(Count));
+    Alive = true;
+}
+
+StrPool::ThreadCache::~ThreadCache()
+{
+    // Hand everything over to the depot. Strings destroyed after this (e.g. other thread_local objects) go straight to it.
+    for (int size_class = 0; size_class < CLASS_COUNT; size_class++)
+        if (Head[size_class])
+            push_batch(size_class, Head[size_class]);
+    Alive = false;
+}
+
+StrPool::ThreadCache& StrPool::get_thread_cache()
+{
+    static thread_local ThreadCache cache;
+    return cache;
+}
+
+StrPool::Depot& StrPool::get_depot()
+{
+    static Depot depot;
+    return depot;
+}
+
+void    StrPool::push_batch(int size_class, void* batch)
+{
+    Depot& depot = get_depot();
+    std::lock_guard<std::mutex> lock(depot.Mutex);
+    ((void**)batch)[1] = depot.Batches[size_class].load(std::memory_order_relaxed);
+    depot.Batches[size_class].store(batch, std::memory_order_relaxed);
+}
+
+void*   StrPool::pop_batch(int size_class)
+{
+    Depot& depot = get_depot();
+    if (depot.Batches[size_class].load(std::memory_order_relaxed) == NULL) // Don't lock on a miss
+        return NULL;
+    std::lock_guard<std::mutex> lock(depot.Mutex);
+    void* batch = depot.Batches[size_class].load(std::memory_order_relaxed);
+    if (batch)
+        depot.Batches[size_class].store(((void**)batch)[1], std::memory_order_relaxed);
+    return batch;
+}
+
+void*   StrPool::alloc(size_t size)
+{
+    if (size > STR_POOL_MAX_SIZE)
+        return STR_MEMALLOC(size);
+    int size_class = size_to_class(size);
+    ThreadCache& cache = get_thread_cache();
+    if (cache.Alive)
+    {
+        if (cache.Head[size_class] == NULL)
+        {
+            cache.Head[size_class] = pop_batch(size_class);
+            cache.Count[size_class] = cache.Head[size_class] ? STR_POOL_BATCH_SIZE : 0;
+        }
+        if (void* block = cache.Head[size_class])
+        {
+            cache.Head[size_class] = *(void**)block;
+            cache.Count[size_class] = cache.Head[size_class] ? cache.Count[size_class] - 1 : 0; // Count is approximate after a depot refill
+            return block;
+        }
+    }
+    return STR_MEMALLOC(class_to_size(size_class));
+}
+
+void    StrPool::dealloc(void* ptr, size_t size)
+{
+    if (size > STR_POOL_MAX_SIZE)
+    {
+        STR_MEMFREE(ptr);
+        return;
+    }
+    int size_class = size_to_class(size);
+    STR_ASSERT(class_to_size(size_class) == size && "StrPool::dealloc() size must be the allocated size");
+    ThreadCache& cache = get_thread_cache();
+    if (!cache.Alive)
+    {
+        *(void**)ptr = NULL;
+        push_batch(size_class, ptr);
+        return;
+    }
+    *(void**)ptr = cache.Head[size_class];
+    cache.Head[size_class] = ptr;
+    if (++cache.Count[size_class] < 2 * STR_POOL_BATCH_SIZE)
+        return;
+
+    // Too many cached blocks: move a batch to the depot
+    void* batch = cache.Head[size_class];
+    void* last = batch;
+    int batch_size = 1;
+    for (; batch_size < STR_POOL_BATCH_SIZE && *(void**)last != NULL; batch_size++)
+        last = *(void**)last;
+    cache.Head[size_class] = *(void**)last;
+    cache.Count[size_class] = cache.Head[size_class] ? cache.Count[size_class] - batch_size : 0;
+    *(void**)last = NULL;
+    push_batch(size_class, batch);
+}
+
+void    StrPool::release_cached()
+{
+    auto free_list = [](void* block) { while (block) { void* next = *(void**)block; STR_MEMFREE(block); block = next; } };
+    ThreadCache& cache = get_thread_cache();
+    for (int size_class = 0; size_class < CLASS_COUNT; size_class++)
+    {
+        free_list(cache.Head[size_class]);
+        cache.Head[size_class] = NULL;
+        cache.Count[size_class] = 0;
+    }
+    Depot& depot = get_depot();
+    std::lock_guard<std::mutex> lock(depot.Mutex);
+    for (int size_class = 0; size_class < CLASS_COUNT; size_class++)
+    {
+        for (void* batch = depot.Batches[size_class].load(std::memory_order_relaxed); batch != NULL; )
+        {
+            void* next_batch = ((void**)batch)[1];
+            free_list(batch);
+            batch = next_batch;
+        }
+        depot.Batches[size_class].store(NULL, std::memory_order_relaxed);
+    }
+}
+
+std::atomic<uint64_t> StrInternPool::TotalLookups;
+std::atomic<uint64_t> StrInternPool::TotalHits;
+
+StrInternPool::Shard* StrInternPool::get_shards()
+{
+    static Shard shards[STR_INTERN_SHARDS];
+    return shards;
+}
+
+StrInternPool::ThreadCounters& StrInternPool::get_thread_counters()
+{
+    static thread_local ThreadCounters counters;
+    return counters;
+}
+
+void    StrInternPool::ThreadCounters::flush()
+{
+    TotalLookups.fetch_add(Lookups, std::memory_order_relaxed);
+    TotalHits.fetch_add(Hits, std::memory_order_relaxed);
+    Lookups = Hits = 0;
+}
+
+void    StrInternPool::count_lookup(bool hit)
+{
+    ThreadCounters& counters = get_thread_counters();
+    counters.Hits += hit;
+    if (++counters.Lookups == 256)
+        counters.flush();
+}
+
+const StrInternPool::Entry* StrInternPool::find(Table* table, std::string_view s, uint64_t hash)
+{
+    if (table == NULL)
+        return NULL;
+    std::atomic<Entry*>* slots = table->get_slots();
+    int mask = table->Capacity - 1;
+    for (int idx = (int)hash & mask; ; idx = (idx + 1) & mask)
+    {
+        const Entry* entry = slots[idx].load(std::memory_order_acquire);
+        if (entry == NULL)
+            return NULL;
+        if (entry->Hash == hash && entry->Size == s.size() && StrSimd::equal(entry->get_data(), s.data(), s.size()))
+            return entry;
+    }
+}
+
+// Called with the shard locked. The old table stays readable: lookups that started on it either find what they are
+// looking for or fall back to the locked path.
+StrInternPool::Table* StrInternPool::grow(Shard& shard)
+{
+    Table* old_table = shard.Current.load(std::memory_order_relaxed);
+    int capacity = old_table ? old_table->Capacity * 2 : 64;
+    Table* table = (Table*)STR_MEMALLOC(sizeof(Table) + sizeof(std::atomic<Entry*>) * capacity);
+    table->Capacity = capacity;
+    table->Prev = old_table;
+    std::atomic<Entry*>* slots = table->get_slots();
+    for (int idx = 0; idx < capacity; idx++)
+        new (&slots[idx]) std::atomic<Entry*>(NULL);
+    for (int old_idx = 0; old_table && old_idx < old_table->Capacity; old_idx++)
+        if (Entry* entry = old_table->get_slots()[old_idx].load(std::memory_order_relaxed))
+        {
+            int idx = (int)entry->Hash & (capacity - 1);
+            while (slots[idx].load(std::memory_order_relaxed) != NULL)
+                idx = (idx + 1) & (capacity - 1);
+            slots[idx].store(entry, std::memory_order_relaxed);
+        }
+    shard.Current.store(table, std::memory_order_release);
+    return table;
+}
+
+std::string_view StrInternPool::intern(std::string_view s)
+{
+    uint64_t hash = StrSimd::hash(s.data(), s.size());
+    Shard& shard = get_shards()[(hash >> 32) % STR_INTERN_SHARDS];
+    if (const Entry* entry = find(shard.Current.load(std::memory_order_acquire), s, hash))
+    {
+        count_lookup(true);
+        return std::string_view(entry->get_data(), entry->Size);
+    }
+
+    std::lock_guard<std::mutex> lock(shard.Mutex);
+    Table* table = shard.Current.load(std::memory_order_relaxed);
+    if (const Entry* entry = find(table, s, hash)) // Interned by another thread in the meantime
+    {
+        count_lookup(true);
+        return std::string_view(entry->get_data(), entry->Size);
+    }
+    if (table == NULL || (shard.Count + 1) * 4 > table->Capacity * 3) // Max load factor 3/4
+        table = grow(shard);
+
+    size_t entry_size = (sizeof(Entry) + s.size() + 1 + alignof(Entry) - 1) & ~(alignof(Entry) - 1);
+    if ((size_t)(shard.ChunkEnd - shard.ChunkPtr) < entry_size)
+    {
+        size_t chunk_size = std::max(entry_size, (size_t)STR_ARENA_CHUNK_SIZE);
+        shard.ChunkPtr = (char*)STR_MEMALLOC(chunk_size);
+        shard.ChunkEnd = shard.ChunkPtr + chunk_size;
+    }
+    Entry* entry = (Entry*)shard.ChunkPtr;
+    shard.ChunkPtr += entry_size;
+    entry->Hash = hash;
+    entry->Size = (uint32_t)s.size();
+    char* data = (char*)entry->get_data();
+    STR_MEMCPY(data, s.data(), s.size());
+    data[s.size()] = '\0';
+
+    int mask = table->Capacity - 1;
+    int idx = (int)hash & mask;
+    while (table->get_slots()[idx].load(std::memory_order_relaxed) != NULL)
+        idx = (idx + 1) & mask;
+    table->get_slots()[idx].store(entry, std::memory_order_release); // Publishes the entry contents to lock-free readers
+    shard.Count++;
+    shard.Bytes += entry_size;
+    count_lookup(false);
+    return std::string_view(data, s.size());
+}
+
+StrInternPool::Stats StrInternPool::get_stats()
+{
+    get_thread_counters().flush();
+    Stats stats = {};
+    stats.Lookups = TotalLookups.load(std::memory_order_relaxed);
+    stats.Hits = TotalHits.load(std::memory_order_relaxed);
+    Shard* shards = get_shards();
+    for (int shard_idx = 0; shard_idx < STR_INTERN_SHARDS; shard_idx++)
+    {
+        Shard& shard = shards[shard_idx];
+        std::lock_guard<std::mutex> lock(shard.Mutex);
+        stats.Count += shard.Count;
+        stats.Bytes += shard.Bytes;
+    }
+    return stats;
+}
+
+// Searches
+size_t  Str::find(char c, size_t pos) const
+{
+    size_t size = get_size();
+    if (pos >= size)
+        return npos;
+    size_t i = StrSimd::find_byte(get_data() + pos, size - pos, c);
+    return i == npos ? npos : pos + i;
+}
+
+size_t  Str::find(std::string_view s, size_t pos) const
+{
+    size_t size = get_size();
+    if (pos > size)
+        return npos;
+    size_t i = StrSimd::find(get_data() + pos, size - pos, s.data(), s.size());
+    return i == npos ? npos : pos + i;
+}
+
+size_t  Str::rfind(char c, size_t pos) const
+{
+    size_t size = get_size();
+    if (size == 0)
+        return npos;
+    return StrSimd::rfind_byte(get_data(), std::min(pos, size - 1) + 1, c);
+}
+
+size_t  Str::rfind(std::string_view s, size_t pos) const
+{
+    size_t size = get_size();
+    if (s.size() > size)
+        return npos;
+    size_t last_start = std::min(pos, size - s.size());
+    return StrSimd::rfind(get_data(), last_start + s.size(), s.data(), s.size());
+}
+
+size_t  Str::find_first_of(const StrByteSet& set, size_t pos) const
+{
+    size_t size = get_size();
+    if (pos >= size)
+        return npos;
+    size_t i = StrSimd::find_of(get_data() + pos, size - pos, set, true);
+    return i == npos ? npos : pos + i;
+}
+
+size_t  Str::find_first_not_of(const StrByteSet& set, size_t pos) const
+{
+    size_t size = get_size();
+    if (pos >= size)
+        return npos;
+    size_t i = StrSimd::find_of(get_data() + pos, size - pos, set, false);
+    return i == npos ? npos : pos + i;
+}
+
+// Clear
+void    Str::clear()
+{
+    free_heap_buf();
+    set_empty_buf();
+}
+
+void    Str::set_shared(std::string_view s)
+{
+    STR_TELEMETRY_ADD(StrTelemetryCounter_AllocCount, 1);
+    STR_TELEMETRY_ADD(StrTelemetryCounter_AllocBytes, s.size() + 1);
+    StrSharedHeader* header = (StrSharedHeader*)STR_MEMALLOC(sizeof(StrSharedHeader) + s.size() + 1);
+    new (header) StrSharedHeader();
+    header->RefCount.store(1, std::memory_order_relaxed);
+    header->Capacity = s.size() + 1;
+    char* data = (char*)(header + 1);
+    STR_MEMCPY(data, s.data(), s.size()); // s may point into our current buffer, which is only released below
+    data[s.size()] = 0;
+
+    free_heap_buf();
+    set_view_buf(data, s.size());
+    m_shared = 1;
+    STR_PROFILE_PEAK(s.size() + 1);
+}
+
+#if STR_POSIX
+// The mapping is one anonymous page holding the StrSharedHeader (at its end), followed by the file mapped with MAP_FIXED
+// over more anonymous pages: the zeroes after the end of the file make c_str() terminated, even for page-multiple sizes.
+bool    Str::set_mapped_file(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return false;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        size_t size = (size_t)st.st_size;
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t capacity = (size + 1 + page_size - 1) & ~(page_size - 1);
+        char* mapping = (char*)mmap(NULL, page_size + capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping != MAP_FAILED)
+        {
+            char* data = mapping + page_size;
+            if (mmap(data, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED)
+            {
+                close(fd);
+                StrSharedHeader* header = (StrSharedHeader*)data - 1;
+                new (header) StrSharedHeader();
+                header->RefCount.store(1, std::memory_order_relaxed);
+                header->MapOffset = (int)page_size;
+                header->Capacity = capacity;
+                free_heap_buf();
+                set_view_buf(data, size);
+                m_shared = 1;
+                return true;
+            }
+            munmap(mapping, page_size + capacity);
+        }
+        // Fall back to reading
+    }
+
+    // Pipes, character devices, files reporting a size of 0 (/proc): read() until the end
+    Str contents;
+    size_t size = 0;
+    for (;;)
+    {
+        contents.grow(size + 4096 + 1);
+        ssize_t read_size = read(fd, contents.get_data() + size, contents.get_capacity() - size - 1);
+        if (read_size < 0 && errno == EINTR)
+            continue;
+        if (read_size <= 0)
+        {
+            int error = errno;
+            close(fd);
+            if (read_size < 0)
+            {
+                errno = error;
+                return false;
+            }
+            break;
+        }
+        size += (size_t)read_size;
+        contents.get_data()[size] = 0;
+        contents.set_size(size);
+    }
+    if (size == 0)
+        clear();
+    else if (m_alloc)
+        set(contents.view());   // Our allocator can't free the buffer read into
+    else
+        steal_buf(contents);    // Both come from the default allocator (or the current arena, like any allocation of ours)
+    return true;
+}
+#endif
 
-// Static empty buffer we can point to for empty strings
-// Pointing to a literal increases the like-hood of getting a crash if someone attempts to write in the empty string buffer.
-char*   Str::EmptyBuffer = (char*)"\0NULL";
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Warray-bounds"                  // warning: array subscript is outside array bounds of 'Str [1]' (trailing storage of StrN/StrAllocN on a plain Str)
+#pragma GCC diagnostic ignored "-Wstringop-overflow"             // warning: writing 1 byte into a region of size 0 (same)
+#endif
 
-// Clear
-void    Str::clear()
+// Point to the local buffer if any, or the shared empty buffer (doesn't free anything)
+void    Str::set_empty_buf()
 {
-    if (m_owned && !is_using_local_buf())
-        STR_MEMFREE(m_data);
+    clear_inline();
     if (m_local_size)
     {
         m_data = local_buf();
         m_data[0] = '\0';
-        m_capacity = m_local_size;
+        m_capacity = decode_local_size((int)m_local_size);
         m_owned = 1;
     }
     else
     {
-        m_data = EmptyBuffer;
+        m_data = const_cast<char*>(EmptyBuffer);
         m_capacity = 0;
         m_owned = 0;
     }
     m_size = 0;
+    m_arena = 0;
+    m_shared = 0;
+    m_large = 0;
 }
 
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
 // Reserve memory, preserving the current of the buffer
-void    Str::reserve(int new_capacity)
+void    Str::reserve(size_t new_capacity)
 {
-    if (new_capacity <= m_capacity)
+    size_t capacity = get_capacity();
+    if (new_capacity <= capacity)
+    {
+        STR_TELEMETRY_ADD(is_using_local_buf() ? StrTelemetryCounter_ReserveLocal : StrTelemetryCounter_ReserveHeap, 1);
         return;
+    }
 
     char* new_data;
-    if (new_capacity < m_local_size) {
+    bool new_arena = false;
+    if (new_capacity < (size_t)get_local_size()) {
         // Disowned -> LocalBuf
+        STR_TELEMETRY_ADD(StrTelemetryCounter_ReserveLocal, 1);
         new_data = local_buf();
-        new_capacity = m_local_size;
+        new_capacity = get_local_size();
+    } else if (can_use_inline(new_capacity)) {
+        // Disowned -> Inline
+        STR_TELEMETRY_ADD(StrTelemetryCounter_ReserveLocal, 1);
+        set_inline_buf(view());
+        return;
+    } else if (m_arena && m_owned && !m_large && new_capacity <= SMALL_MAX && !is_using_local_buf() && StrArenaScope::get_current() && StrArenaScope::get_current()->extend(m_data, capacity, new_capacity)) {
+        // Last allocation of the arena: grow in place
+        new_capacity = mem_good_size(new_capacity);
+        STR_TELEMETRY_ADD(StrTelemetryCounter_ReserveHeap, 1);
+        STR_TELEMETRY_ADD(StrTelemetryCounter_AllocBytes, (uint64_t)(new_capacity - capacity));
+        m_capacity = new_capacity;
+        return;
     } else {
         // Disowned or LocalBuf -> Heap
-        new_data = (char*)STR_MEMALLOC(new_capacity);
+#if STR_TELEMETRY
+        telemetry_heap_reserve();
+#endif
+        new_capacity = mem_good_size(new_capacity);
+        new_data = alloc_heap_buf(new_capacity, &new_arena);
     }
 
-    memcpy(new_data, m_data, m_size);
-    new_data[m_size] = 0;
+    size_t size = get_size();
+    STR_TELEMETRY_ADD(StrTelemetryCounter_CopyCount, size ? 1 : 0);
+    STR_TELEMETRY_ADD(StrTelemetryCounter_CopyBytes, size);
+    STR_MEMCPY(new_data, get_data(), size);
+    new_data[size] = 0;
 
-    if (m_owned && !is_using_local_buf())
-        STR_MEMFREE(m_data);
-
-    m_data = new_data;
-    m_capacity = new_capacity;
-    m_owned = 1;
+    free_heap_buf();
+    set_owned_buf(new_data, new_capacity, size, new_arena);
 }
 
 // Reserve memory, discarding the current of the buffer (if we expect to be fully rewritten)
-void    Str::reserve_discard(int new_capacity)
+void    Str::reserve_discard(size_t new_capacity)
 {
-    if (m_owned && new_capacity <= m_capacity)
+    if (m_owned && new_capacity <= get_capacity())
+    {
+        STR_TELEMETRY_ADD(is_using_local_buf() ? StrTelemetryCounter_ReserveLocal : StrTelemetryCounter_ReserveHeap, 1);
         return;
+    }
 
-    if (m_owned && !is_using_local_buf())
-        STR_MEMFREE(m_data);
+#if STR_TELEMETRY
+    if (new_capacity < (size_t)get_local_size() || can_use_inline(new_capacity))
+        STR_TELEMETRY_ADD(StrTelemetryCounter_ReserveLocal, 1);
+    else
+        telemetry_heap_reserve();
+#endif
+    if (can_use_inline(new_capacity))
+    {
+        // Disowned -> Inline
+        set_inline_buf(std::string_view("", 0));
+        return;
+    }
+    free_heap_buf();
 
-    if (new_capacity < m_local_size)
+    if (new_capacity < (size_t)get_local_size())
     {
         // Disowned -> LocalBuf
-        m_data = local_buf();
-        m_capacity = m_local_size;
+        set_owned_buf(local_buf(), get_local_size(), 0, false);
     }
     else
     {
         // Disowned or LocalBuf -> Heap
-        m_data = (char*)STR_MEMALLOC((size_t)new_capacity);
-        m_capacity = new_capacity;
+        bool new_arena = false;
+        new_capacity = mem_good_size(new_capacity);
+        char* new_data = alloc_heap_buf(new_capacity, &new_arena);
+        set_owned_buf(new_data, new_capacity, 0, new_arena);
     }
-    m_owned = 1;
+    get_data()[0] = 0;
+}
+
+#if STR_TELEMETRY
+// Count a reserve going to the heap, and whether it is the string leaving its local buffer
+void    Str::telemetry_heap_reserve()
+{
+    StrTelemetry::add(StrTelemetryCounter_ReserveHeap, 1);
+    if (get_local_size() && (!m_owned || is_using_local_buf()))
+    {
+        StrTelemetry::add(StrTelemetryCounter_Spill, 1);
+        StrTelemetry::add(StrTelemetry::get_spill_counter(get_local_size()), 1);
+    }
+}
+#endif
+
+// Reserve memory for append operations, rounding the capacity up according to the growth policy
+void    Str::grow(size_t needed_capacity)
+{
+    size_t capacity = get_capacity();
+    if (needed_capacity <= capacity)
+        return;
+
+    size_t new_capacity = capacity;
+    switch (m_growth)
+    {
+    case StrGrowth_Default:   new_capacity += (capacity < STR_GROWTH_THRESHOLD) ? capacity : capacity / 2; break;
+    case StrGrowth_Factor2:   new_capacity += capacity; break;
+    case StrGrowth_Factor1_5: new_capacity += capacity / 2; break;
+    case StrGrowth_Exact:     break;
+    }
+    if (new_capacity < needed_capacity)
+        new_capacity = needed_capacity;
+    reserve(new_capacity);
 }
 
 void    Str::shrink_to_fit()
 {
-    if (!m_owned || is_using_local_buf())
+    if (!m_owned || is_using_local_buf() || m_arena) // Nothing to give back to an arena
+        return;
+    size_t size = get_size();
+    if (can_use_inline(size + 1))
+    {
+        set_inline_buf(view());
         return;
-    int new_capacity = m_size + 1;
-    if (m_capacity <= new_capacity)
+    }
+    size_t new_capacity = mem_good_size(size + 1);
+    if (get_capacity() <= new_capacity)
         return;
 
-    char* new_data = (char*)STR_MEMALLOC((size_t)new_capacity);
-    memcpy(new_data, m_data, (size_t)new_capacity);
-    STR_MEMFREE(m_data);
-    m_data = new_data;
-    m_capacity = new_capacity;
+    bool new_arena;
+    char* new_data = alloc_heap_buf(new_capacity, &new_arena);
+    STR_MEMCPY(new_data, m_data, size + 1);
+    free_heap_buf();
+    set_owned_buf(new_data, new_capacity, size, new_arena);
 }
 
-template<typename... Args>
-int     Str::setf(fmt::format_string<Args...> fm, Args&&... args)
+ptrdiff_t Str::append(std::string_view s)
 {
-    int len = fmt::formatted_size(fm, std::forward<Args>(args)...);
-    if (m_capacity < len + 1)
-        reserve_discard(len + 1);
-    STR_ASSERT(m_owned);
-    fmt::format_to_n(m_data, m_capacity, fm, std::forward<Args>(args)...);
+    size_t size = get_size();
+    grow(size + s.size() + 1);
+    char* data = get_data();
+    STR_MEMCPY(data + size, s.data(), s.size());
+    size += s.size();
+    data[size] = 0;
+    set_size(size);
+    STR_PROFILE_PEAK(size + 1);
+    return (ptrdiff_t)s.size();
+}
+
+ptrdiff_t Str::append_nogrow(std::string_view s)
+{
+    size_t size = get_size();
+    if (get_capacity() < size + s.size() + 1)
+        return -1;
+    char* data = get_data();
+    STR_MEMCPY(data + size, s.data(), s.size());
+    size += s.size();
+    data[size] = 0;
+    set_size(size);
+    STR_PROFILE_PEAK(size + 1);
+    return (ptrdiff_t)s.size();
+}
 
+// 'format' writes at most StrNumber::BufferSize characters and returns how many. With room for that many it writes in
+// place, otherwise into a stack buffer which is then appended, so capacities are the same as with append().
+template<typename FORMAT>
+ptrdiff_t Str::append_number(bool can_grow, FORMAT&& format)
+{
+    size_t size = get_size();
+    if (!m_owned || get_capacity() < size + StrNumber::BufferSize + 1)
+    {
+        char buf[StrNumber::BufferSize];
+        std::string_view s(buf, (size_t)format(buf));
+        return can_grow ? append(s) : append_nogrow(s);
+    }
+    char* data = get_data();
+    int len = format(data + size);
+    size += (size_t)len;
+    data[size] = 0;
+    set_size(size);
+    STR_PROFILE_PEAK(size + 1);
     return len;
 }
 
-template<typename... Args>
-int     Str::setf_nogrow(fmt::format_string<Args...> fm, Args&&... args)
+// fmt output buffer writing straight into the storage of a Str (local buffer or heap), growing it through
+// Str::grow() when fmt needs more room, so that every call formats exactly once.
+// Output lands after the first 'offset' bytes of the string, which are preserved.
+// A string that has no writable room yet (reference, full or empty heap buffer) is first formatted into a small
+// stack buffer, which lets short outputs get a single allocation instead of one per growth step.
+class StrFmtBuffer : public fmt::detail::buffer<char>
 {
-    int len = fmt::formatted_size(fm, std::forward<Args>(args)...);
-    if (m_capacity < len + 1)
-        reserve_discard(len + 1);
-    STR_ASSERT(m_owned);
-    fmt::format_to_n(m_data, m_capacity, fm, std::forward<Args>(args)...);
+public:
+    StrFmtBuffer(Str& str, size_t offset, bool can_grow);
+    int     finish(); // Commit output into the Str. Returns the formatted length, or -1 if it didn't fit and we couldn't grow.
 
-    return len;
+private:
+    Str&    m_str;
+    size_t  m_offset;
+    bool    m_can_grow;
+    bool    m_in_str;       // Writing into m_str storage (vs m_scratch)
+    bool    m_overflow;     // Output didn't fit and we couldn't grow, the rest is discarded into m_scratch
+    char    m_scratch[128];
+
+    void    grow_to(size_t capacity);
+#if FMT_VERSION >= 100000
+    static void grow_thunk(fmt::detail::buffer<char>& buf, size_t capacity) { static_cast<StrFmtBuffer&>(buf).grow_to(capacity); }
+#else
+    void    grow(size_t capacity) override { grow_to(capacity); }
+#endif
+};
+
+StrFmtBuffer::StrFmtBuffer(Str& str, size_t offset, bool can_grow)
+#if FMT_VERSION >= 100000
+    : fmt::detail::buffer<char>(grow_thunk), m_str(str)
+#else
+    : m_str(str)
+#endif
+{
+    m_offset = offset;
+    m_can_grow = can_grow;
+    m_overflow = false;
+    size_t capacity = str.m_owned ? str.get_capacity() : 0; // Can't write into referenced data
+    size_t room = capacity > offset + 1 ? capacity - offset - 1 : 0;
+    m_in_str = (room > 0);
+    if (m_in_str)
+        set(str.get_data() + offset, room);
+    else
+        set(m_scratch, sizeof(m_scratch));
+    if (!m_in_str && !can_grow)
+        m_overflow = true; // No writable room at all (reference, empty or full buffer): not even the terminator fits
 }
 
-int     Str::append(std::string_view s)
+void    StrFmtBuffer::grow_to(size_t capacity)
 {
-    reserve(size() + s.size() + 1);
-    memcpy(m_data + size(), s.data(), s.size());
-    m_size += s.size();
-    m_data[m_size] = 0;
-    return s.size();
+    if (!m_can_grow)
+    {
+        // Keep going to let fmt finish, we only care about having overflowed
+        m_overflow = true;
+        clear();
+        set(m_scratch, sizeof(m_scratch));
+        return;
+    }
+
+    // Commit what was written so far so that reserve() carries it over
+    m_str.set_size(m_offset + (m_in_str ? size() : 0));
+    if (!m_str.m_owned)
+        m_str.reserve(m_offset + 1); // Detach from referenced data even if it looks large enough
+    m_str.grow(m_offset + capacity + 1);
+    if (!m_in_str)
+        STR_MEMCPY(m_str.get_data() + m_offset, m_scratch, size());
+    m_in_str = true;
+    set(m_str.get_data() + m_offset, m_str.get_capacity() - m_offset - 1);
 }
 
-int     Str::append_nogrow(std::string_view s)
+int     StrFmtBuffer::finish()
 {
-    if (m_capacity < m_size + s.size() + 1)
+    if (m_overflow)
+    {
+        if (m_str.m_owned)
+        {
+            m_str.set_size(m_offset);
+            m_str.get_data()[m_offset] = 0;
+        }
+        else if (m_offset == 0)
+        {
+            m_str.clear(); // Can't truncate referenced data in place
+        }
         return -1;
-    int to_copy = std::min((int)s.size(), std::max(0, m_capacity - m_size - 1));
-    strncpy(m_data + m_size, s.data(), to_copy);
-    m_size += to_copy;
-    m_data[m_size] = 0;
-    return to_copy;
+    }
+
+    size_t len = size();
+    if (!m_in_str)
+    {
+        m_str.set_size(m_offset);
+        if (!m_str.m_owned)
+            m_str.reserve(m_offset + 1);
+        m_str.grow(m_offset + len + 1);
+        STR_MEMCPY(m_str.get_data() + m_offset, m_scratch, len);
+    }
+    m_str.set_size(m_offset + len);
+    m_str.get_data()[m_offset + len] = 0;
+#if STR_PROFILE_SITES
+    m_str.profile_peak(m_offset + len + 1);
+#endif
+    return (int)len;
+}
+
+int     Str::vformat_at(size_t offset, bool can_grow, fmt::string_view fm, fmt::format_args args)
+{
+    StrFmtBuffer buf(*this, offset, can_grow);
+    fmt::vformat_to(fmt::appender(buf), fm, args);
+    return buf.finish();
+}
+
+// Same with a FMT_COMPILE() format: no parsing nor argument type dispatch at runtime, literal parts are copied straight
+// into the string storage
+template<StrCompiledFormat S, typename... Args>
+int     Str::format_compiled_at(size_t offset, bool can_grow, const S& fm, Args&&... args)
+{
+    StrFmtBuffer buf(*this, offset, can_grow);
+    fmt::format_to(fmt::appender(buf), fm, std::forward<Args>(args)...);
+    return buf.finish();
+}
+
+template<typename... Args>
+int     Str::setf(fmt::format_string<Args...> fm, Args&&... args)
+{
+    return vformat_at(0, true, fm, fmt::make_format_args(args...));
+}
+
+// Returns -1 and leaves the string empty if the output doesn't fit in the current capacity
+template<typename... Args>
+int     Str::setf_nogrow(fmt::format_string<Args...> fm, Args&&... args)
+{
+    return vformat_at(0, false, fm, fmt::make_format_args(args...));
 }
 
 template<typename... Args>
 int     Str::appendf(fmt::format_string<Args...> fm, Args&&... args)
 {
-    int len = fmt::formatted_size(fm, std::forward<Args>(args)...);
-    if (m_capacity < len + 1)
-        reserve(len + 1);
-    STR_ASSERT(m_owned);
-    fmt::format_to_n(m_data + m_size, m_capacity, fm, std::forward<Args>(args)...);
-    m_size += len;
-    m_data[m_size] = 0;
-    return len;
+    return vformat_at(get_size(), true, fm, fmt::make_format_args(args...));
 }
 
+// Returns -1 and leaves the string unmodified if the output doesn't fit in the current capacity
 template<typename... Args>
 int     Str::appendf_nogrow(fmt::format_string<Args...> fm, Args&&... args)
 {
-    int len = fmt::formatted_size(fm, std::forward<Args>(args)...);
-    if (m_capacity < len + 1)
+    return vformat_at(get_size(), false, fm, fmt::make_format_args(args...));
+}
+
+template<typename VALUE, size_t KEY_LOCAL_SIZE>
+int     StrHashMap<VALUE, KEY_LOCAL_SIZE>::find_index(std::string_view key, uint64_t hash) const
+{
+    if (m_size == 0)
         return -1;
+    uint32_t tag = make_tag(hash);
+    int mask = m_capacity - 1;
+    for (int idx = (int)(tag & mask); ; idx = (idx + 1) & mask)
+    {
+        const Entry& entry = m_entries[idx];
+        if (entry.Tag == 0)
+            return -1;
+        if (entry.Tag == tag && entry.Key == key)
+            return idx;
+    }
+}
 
-    STR_ASSERT(m_owned);
-    fmt::format_to_n(m_data + m_size, m_capacity, fm, std::forward<Args>(args)...);
-    m_size += len;
-    m_data[m_size] = 0;
-    return len;
+template<typename VALUE, size_t KEY_LOCAL_SIZE>
+int     StrHashMap<VALUE, KEY_LOCAL_SIZE>::insert_index(std::string_view key, uint64_t hash, bool* out_inserted)
+{
+    if ((m_size + 1) * 4 > m_capacity * 3) // Max load factor 3/4
+        rehash(m_capacity ? m_capacity * 2 : 16);
+    uint32_t tag = make_tag(hash);
+    int mask = m_capacity - 1;
+    int idx = (int)(tag & mask);
+    for (; m_entries[idx].Tag != 0; idx = (idx + 1) & mask)
+        if (m_entries[idx].Tag == tag && m_entries[idx].Key == key)
+        {
+            *out_inserted = false;
+            return idx;
+        }
+    new (&m_entries[idx].Key) StrN<KEY_LOCAL_SIZE>(key);
+    m_entries[idx].Tag = tag;
+    m_size++;
+    *out_inserted = true;
+    return idx;
+}
+
+template<typename VALUE, size_t KEY_LOCAL_SIZE>
+bool    StrHashMap<VALUE, KEY_LOCAL_SIZE>::insert(std::string_view key, const VALUE& value)
+{
+    bool inserted;
+    int idx = insert_index(key, StrSimd::hash(key.data(), key.size()), &inserted);
+    if (inserted)
+        new (&m_entries[idx].Value) VALUE(value);
+    return inserted;
+}
+
+template<typename VALUE, size_t KEY_LOCAL_SIZE>
+VALUE&  StrHashMap<VALUE, KEY_LOCAL_SIZE>::operator[](std::string_view key)
+{
+    bool inserted;
+    int idx = insert_index(key, StrSimd::hash(key.data(), key.size()), &inserted);
+    if (inserted)
+        new (&m_entries[idx].Value) VALUE();
+    return m_entries[idx].Value;
+}
+
+template<typename VALUE, size_t KEY_LOCAL_SIZE>
+bool    StrHashMap<VALUE, KEY_LOCAL_SIZE>::erase(std::string_view key)
+{
+    int idx = find_index(key, StrSimd::hash(key.data(), key.size()));
+    if (idx < 0)
+        return false;
+    m_entries[idx].Key.~StrN<KEY_LOCAL_SIZE>();
+    m_entries[idx].Value.~VALUE();
+    m_entries[idx].Tag = 0;
+    m_size--;
+
+    // Backward shift deletion: move following entries of the probe sequence into the hole, no tombstones needed
+    int mask = m_capacity - 1;
+    int hole = idx;
+    for (int next = (idx + 1) & mask; m_entries[next].Tag != 0; next = (next + 1) & mask)
+    {
+        int home = (int)(m_entries[next].Tag & mask);
+        if (((next - home) & mask) < ((next - hole) & mask))
+            continue; // Can't move before its home slot
+        Entry& src = m_entries[next];
+        Entry& dst = m_entries[hole];
+        new (&dst.Key) StrN<KEY_LOCAL_SIZE>(std::move(src.Key));
+        new (&dst.Value) VALUE(std::move(src.Value));
+        dst.Tag = src.Tag;
+        src.Key.~StrN<KEY_LOCAL_SIZE>();
+        src.Value.~VALUE();
+        src.Tag = 0;
+        hole = next;
+    }
+    return true;
+}
+
+template<typename VALUE, size_t KEY_LOCAL_SIZE>
+void    StrHashMap<VALUE, KEY_LOCAL_SIZE>::clear()
+{
+    for (int i = 0; i < m_capacity; i++)
+        if (m_entries[i].Tag)
+        {
+            m_entries[i].Key.~StrN<KEY_LOCAL_SIZE>();
+            m_entries[i].Value.~VALUE();
+            m_entries[i].Tag = 0;
+        }
+    m_size = 0;
+}
+
+template<typename VALUE, size_t KEY_LOCAL_SIZE>
+void    StrHashMap<VALUE, KEY_LOCAL_SIZE>::reserve(int count)
+{
+    int new_capacity = 16;
+    while (new_capacity * 3 < count * 4)
+        new_capacity *= 2;
+    if (new_capacity > m_capacity)
+        rehash(new_capacity);
+}
+
+template<typename VALUE, size_t KEY_LOCAL_SIZE>
+void    StrHashMap<VALUE, KEY_LOCAL_SIZE>::rehash(int new_capacity)
+{
+    STR_ASSERT(new_capacity <= (1 << 30) && "StrHashMap: tags only hold 31 bits of hash");
+    void* new_alloc = STR_MEMALLOC(sizeof(Entry) * new_capacity + 63);
+    Entry* new_entries = (Entry*)(((uintptr_t)new_alloc + 63) & ~(uintptr_t)63);
+    for (int i = 0; i < new_capacity; i++)
+        new_entries[i].Tag = 0;
+
+    int new_mask = new_capacity - 1;
+    for (int i = 0; i < m_capacity; i++)
+    {
+        Entry& src = m_entries[i];
+        if (src.Tag == 0)
+            continue;
+        int idx = (int)(src.Tag & new_mask);
+        while (new_entries[idx].Tag != 0)
+            idx = (idx + 1) & new_mask;
+        new (&new_entries[idx].Key) StrN<KEY_LOCAL_SIZE>(std::move(src.Key));
+        new (&new_entries[idx].Value) VALUE(std::move(src.Value));
+        new_entries[idx].Tag = src.Tag;
+        src.Key.~StrN<KEY_LOCAL_SIZE>();
+        src.Value.~VALUE();
+    }
+    STR_MEMFREE(m_alloc);
+    m_alloc = new_alloc;
+    m_entries = new_entries;
+    m_capacity = new_capacity;
+}
+
+void    StrBuilder::push_segment(const char* data, size_t size)
+{
+    if (m_segment_count == m_segment_capacity)
+    {
+        int new_capacity = m_segment_capacity ? m_segment_capacity * 2 : 32;
+        Segment* new_segments = (Segment*)STR_MEMALLOC(sizeof(Segment) * new_capacity);
+        if (m_segment_count)
+            memcpy(new_segments, m_segments, sizeof(Segment) * m_segment_count);
+        STR_MEMFREE(m_segments);
+        m_segments = new_segments;
+        m_segment_capacity = new_capacity;
+    }
+    m_segments[m_segment_count].Data = data;
+    m_segments[m_segment_count].Size = size;
+    m_segment_count++;
+}
+
+void    StrBuilder::new_slab(size_t min_size)
+{
+    size_t slab_size = std::max(min_size, (size_t)STR_BUILDER_SLAB_SIZE);
+    Slab* slab = (Slab*)STR_MEMALLOC(sizeof(Slab) + slab_size);
+    slab->Prev = m_slab;
+    m_slab = slab;
+    m_slab_ptr = (char*)(slab + 1);
+    m_slab_end = m_slab_ptr + slab_size;
+}
+
+void    StrBuilder::commit_slab(size_t size)
+{
+    if (size == 0)
+        return;
+    // Consecutive copies into the same slab extend the last piece
+    Segment* last = m_segment_count ? &m_segments[m_segment_count - 1] : NULL;
+    if (last && last->Data + last->Size == m_slab_ptr)
+        last->Size += size;
+    else
+        push_segment(m_slab_ptr, size);
+    m_slab_ptr += size;
+    m_size += size;
+}
+
+void    StrBuilder::append_copy(std::string_view s)
+{
+    const char* src = s.data();
+    size_t remaining = s.size();
+    while (remaining > 0)
+    {
+        if (m_slab_ptr == m_slab_end)
+            new_slab(remaining);
+        size_t to_copy = std::min(remaining, (size_t)(m_slab_end - m_slab_ptr));
+        STR_MEMCPY(m_slab_ptr, src, to_copy);
+        commit_slab(to_copy);
+        src += to_copy;
+        remaining -= to_copy;
+    }
+}
+
+void    StrBuilder::append_ref(std::string_view s)
+{
+    if (s.empty())
+        return;
+    push_segment(s.data(), s.size());
+    m_size += s.size();
+}
+
+void    StrBuilder::finish(Str* out) const
+{
+    out->clear();
+    out->reserve(m_size + 1);
+    for (int i = 0; i < m_segment_count; i++)
+        out->append(std::string_view(m_segments[i].Data, m_segments[i].Size));
+}
+
+void    StrBuilder::clear()
+{
+    for (Slab* slab = m_slab; slab != NULL; )
+    {
+        Slab* prev = slab->Prev;
+        STR_MEMFREE(slab);
+        slab = prev;
+    }
+    STR_MEMFREE(m_segments);
+    m_segments = NULL;
+    m_segment_count = m_segment_capacity = 0;
+    m_slab = NULL;
+    m_slab_ptr = m_slab_end = NULL;
+    m_size = 0;
+}
+
+// fmt output buffer writing straight into the slabs of a StrBuilder. Output that doesn't fit the current slab continues
+// in a new one (as another piece), so the arguments are only formatted once.
+class StrBuilderFmtBuffer : public fmt::detail::buffer<char>
+{
+public:
+    StrBuilderFmtBuffer(StrBuilder& builder);
+    void    finish()                { m_builder.commit_slab(size()); }
+
+private:
+    StrBuilder& m_builder;
+
+    void    grow_to(size_t capacity);
+#if FMT_VERSION >= 100000
+    static void grow_thunk(fmt::detail::buffer<char>& buf, size_t capacity) { static_cast<StrBuilderFmtBuffer&>(buf).grow_to(capacity); }
+#else
+    void    grow(size_t capacity) override { grow_to(capacity); }
+#endif
+};
+
+StrBuilderFmtBuffer::StrBuilderFmtBuffer(StrBuilder& builder)
+#if FMT_VERSION >= 100000
+    : fmt::detail::buffer<char>(grow_thunk), m_builder(builder)
+#else
+    : m_builder(builder)
+#endif
+{
+    set(builder.m_slab_ptr, (size_t)(builder.m_slab_end - builder.m_slab_ptr));
+}
+
+void    StrBuilderFmtBuffer::grow_to(size_t capacity)
+{
+    // fmt re-reads size() after growing: commit what was written and restart empty in a slab with the missing room
+    size_t missing = capacity - size();
+    m_builder.commit_slab(size());
+    m_builder.new_slab(missing);
+    clear();
+    set(m_builder.m_slab_ptr, (size_t)(m_builder.m_slab_end - m_builder.m_slab_ptr));
+}
+
+template<typename... Args>
+void    StrBuilder::appendf(fmt::format_string<Args...> fm, Args&&... args)
+{
+    StrBuilderFmtBuffer buf(*this);
+    fmt::vformat_to(fmt::appender(buf), fm, fmt::make_format_args(args...));
+    buf.finish();
+}
+
+StrAppendBuffer::StrAppendBuffer(size_t capacity)
+{
+    STR_ASSERT(capacity <= ReservedMask);
+    m_capacity = capacity;
+    for (Buffer& buffer : m_buffers)
+    {
+        buffer.State.store(0, std::memory_order_relaxed);
+        buffer.Data = (char*)STR_MEMALLOC(capacity ? capacity : 1);
+    }
+    m_current.store(0, std::memory_order_release);
+}
+
+ptrdiff_t StrAppendBuffer::append(std::string_view s)
+{
+    if (s.size() > m_capacity)
+        return -1;
+    for (;;)
+    {
+        Buffer& buffer = m_buffers[m_current.load(std::memory_order_acquire)];
+        uint64_t state = buffer.State.load(std::memory_order_relaxed);
+        bool reserved = false;
+        while (!(state & Sealed))
+        {
+            if ((state & ReservedMask) + s.size() > m_capacity)
+                return -1;
+            if (buffer.State.compare_exchange_weak(state, state + Writer + s.size(), std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                reserved = true;
+                break;
+            }
+        }
+        if (!reserved)
+            continue; // Being flushed: m_current already points to the other buffer
+        STR_MEMCPY(buffer.Data + (size_t)(state & ReservedMask), s.data(), s.size());
+        buffer.State.fetch_sub(Writer, std::memory_order_release);
+        return (ptrdiff_t)s.size();
+    }
+}
+
+template<typename FUNC>
+size_t  StrAppendBuffer::flush(FUNC&& func)
+{
+    std::lock_guard<std::mutex> lock(m_flush_mutex);
+    int index = m_current.load(std::memory_order_relaxed);
+    m_current.store(index ^ 1, std::memory_order_release);
+
+    // Appends that reserved before the seal are the ones to wait for, later ones see it and go to the other buffer
+    Buffer& buffer = m_buffers[index];
+    uint64_t state = buffer.State.fetch_or(Sealed, std::memory_order_acq_rel);
+    while ((state & ~(Sealed | ReservedMask)) != 0)
+    {
+        std::this_thread::yield();
+        state = buffer.State.load(std::memory_order_acquire);
+    }
+    size_t size = (size_t)(state & ReservedMask);
+    func(std::string_view(buffer.Data, size));
+
+    // Empty and unseal: nothing else modifies a sealed buffer
+    buffer.State.store(0, std::memory_order_release);
+    return size;
+}
+
+StrSplit Str::split(char delim, int flags, int max_splits) const                 { return StrSplit(view(), delim, flags, max_splits); }
+StrSplit Str::split(std::string_view delim, int flags, int max_splits) const     { return StrSplit(view(), delim, flags, max_splits); }
+StrSplit Str::split(const StrByteSet& delims, int flags, int max_splits) const   { return StrSplit(view(), delims, flags, max_splits); }
+
+size_t  StrSplit::find_delim(size_t pos) const
+{
+    const char* data = m_source.data() + pos;
+    size_t size = m_source.size() - pos;
+    size_t i;
+    if (m_kind == Kind_Char)
+        i = StrSimd::find_byte(data, size, m_char);
+    else if (m_kind == Kind_String)
+        i = m_string.empty() ? std::string_view::npos : StrSimd::find(data, size, m_string.data(), m_string.size());
+    else
+        i = StrSimd::find_of(data, size, m_set, true);
+    return i == std::string_view::npos ? i : pos + i;
+}
+
+size_t  StrSplit::skip_delims(size_t pos) const
+{
+    if (m_kind == Kind_Char)
+    {
+        while (pos < m_source.size() && m_source[pos] == m_char)
+            pos++;
+    }
+    else if (m_kind == Kind_String)
+    {
+        while (!m_string.empty() && m_source.substr(pos).starts_with(m_string))
+            pos += m_string.size();
+    }
+    else
+    {
+        size_t i = StrSimd::find_of(m_source.data() + pos, m_source.size() - pos, m_set, false);
+        pos = (i == std::string_view::npos) ? m_source.size() : pos + i;
+    }
+    return pos;
+}
+
+void    StrSplit::Iterator::advance()
+{
+    const StrSplit& split = *m_split;
+    m_at_end = m_last;
+    if (m_last)
+        return;
+    if (split.m_flags & StrSplitFlags_SkipEmpty)
+    {
+        m_pos = split.skip_delims(m_pos);
+        if (m_pos == split.m_source.size())
+        {
+            m_last = m_at_end = true;
+            return;
+        }
+    }
+    bool can_split = split.m_max_splits < 0 || m_splits < split.m_max_splits;
+    size_t found = can_split ? split.find_delim(m_pos) : std::string_view::npos;
+    if (found == std::string_view::npos)
+    {
+        m_piece = split.m_source.substr(m_pos);
+        m_last = true;
+        return;
+    }
+    m_piece = split.m_source.substr(m_pos, found - m_pos);
+    m_pos = found + split.delim_size();
+    m_splits++;
+}
+
+#if STR_POSIX
+ptrdiff_t StrBuilder::write(int fd) const
+{
+    struct iovec iov[64];
+    ptrdiff_t total = 0;
+    for (int first = 0; first < m_segment_count; first += 64)
+    {
+        int count = std::min(64, m_segment_count - first);
+        for (int i = 0; i < count; i++)
+        {
+            iov[i].iov_base = (void*)m_segments[first + i].Data;
+            iov[i].iov_len = m_segments[first + i].Size;
+        }
+        ptrdiff_t written = StrWriteAll(fd, iov, count);
+        if (written < 0)
+            return -1;
+        total += written;
+    }
+    return total;
+}
+
+void StrIoVec::add(std::string_view s)
+{
+    if (s.empty() || m_written < 0)
+        return;
+    if (s.size() <= STR_IOVEC_COALESCE_MAX_SIZE && s.size() <= (size_t)(STR_IOVEC_SCRATCH_SIZE - m_scratch_size))
+    {
+        // Copy into the scratch buffer, extending the last entry when it ends there
+        char* dst = m_scratch + m_scratch_size;
+        memcpy(dst, s.data(), s.size());
+        m_scratch_size += (int)s.size();
+        if (m_count > 0 && (char*)m_iov[m_count - 1].iov_base + m_iov[m_count - 1].iov_len == dst)
+        {
+            m_iov[m_count - 1].iov_len += s.size();
+            return;
+        }
+        s = std::string_view(dst, s.size());
+    }
+    if (m_count == STR_IOVEC_BATCH)
+    {
+        // 's' may point into the scratch buffer: keep it out of the batch being written
+        bool in_scratch = s.data() >= m_scratch && s.data() < m_scratch + STR_IOVEC_SCRATCH_SIZE;
+        if (in_scratch)
+            m_scratch_size -= (int)s.size();
+        flush();
+        if (m_written < 0)
+            return;
+        if (in_scratch)
+        {
+            memmove(m_scratch, s.data(), s.size());
+            m_scratch_size = (int)s.size();
+            s = std::string_view(m_scratch, s.size());
+        }
+    }
+    m_iov[m_count].iov_base = (void*)s.data();
+    m_iov[m_count].iov_len = s.size();
+    m_count++;
 }
+
+ptrdiff_t StrIoVec::flush()
+{
+    if (m_count > 0 && m_written >= 0)
+    {
+        ptrdiff_t written = StrWriteAll(m_fd, m_iov, m_count);
+        m_written = (written < 0) ? -1 : m_written + written;
+    }
+    m_count = 0;
+    m_scratch_size = 0;
+    return m_written;
+}
+
+ptrdiff_t Str::write_all(int fd, std::span<const Str* const> pieces)
+{
+    StrIoVec out(fd);
+    for (const Str* piece : pieces)
+        out.add(piece->view());
+    return out.flush();
+}
+
+ptrdiff_t StrWriteAll(int fd, struct iovec* iov, int count)
+{
+#ifdef IOV_MAX
+    const int max_count = IOV_MAX;
+#else
+    const int max_count = 1024;
+#endif
+    ptrdiff_t total = 0;
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, std::min(count, max_count));
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += written;
+
+        // Skip what was written, possibly resuming in the middle of an entry
+        size_t left = (size_t)written;
+        while (count > 0 && left >= iov->iov_len)
+        {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return total;
+}
+#endif
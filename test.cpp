@@ -1,8 +1,35 @@
 #include <stdio.h>
 #include <assert.h>
+#include <vector>
+#include <thread>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <memory>
 #include "str.hpp"
 using namespace std::literals;
 
+// Heap allocations made by the current thread, to check that something doesn't allocate. Always 0 unless built with
+// STR_TELEMETRY, as test_instrumented.cpp does.
+static uint64_t get_thread_alloc_count()
+{
+#if STR_TELEMETRY
+    return StrTelemetry::get_thread().Counters[StrTelemetryCounter_AllocCount];
+#else
+    return 0;
+#endif
+}
+
+// Capacity of a heap buffer allocated for 'size' bytes: rounded up to the size class with STR_USE_POOL
+static size_t heap_capacity(size_t size)
+{
+#if STR_USE_POOL
+    return StrPool::good_size(size);
+#else
+    return size;
+#endif
+}
+
 void test_pointer()
 {
     Str128 b = "foo";
@@ -18,6 +45,16 @@ void test_append_nogrow()
     Str16 s = "aaaaaaaaaa";
     assert(s.append_nogrow("bbbbbb") == -1);
     assert(s == "aaaaaaaaaa");
+    assert(s.append_nogrow("b\0c"sv) == 3);
+    assert(s.view() == "aaaaaaaaaab\0c"sv);
+
+    // No writable room at all: fail without writing into referenced or read-only storage
+    Str r = Str::ref("abc");
+    assert(r.appendf_nogrow("") == -1 && r == "abc" && !r.owned());
+    assert(r.setf_nogrow("{}", 1) == -1 && r.empty() && r.c_str()[0] == 0);
+    Str e;
+    assert(e.setf_nogrow("") == -1 && e.empty() && e.c_str()[0] == 0);
+    assert(e.appendf_nogrow("x") == -1 && e.empty());
 }
 
 void test_append()
@@ -40,9 +77,1188 @@ void test_shrink()
     assert(cap2 == cap3);
 }
 
+void test_growth()
+{
+    Str s;
+    int reallocs = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        size_t cap = s.capacity();
+        s.append("abcd");
+        if (s.capacity() != cap)
+            reallocs++;
+    }
+    assert(s.size() == 4000);
+    assert(reallocs < 20);
+
+    Str e;
+    e.set_growth(StrGrowth_Exact);
+    e.append("abcdefgh");
+    e.append("abcdefgh");
+    assert(e.capacity() == heap_capacity(17));
+
+    StrN<16, StrDefaultAllocator, StrGrowth_Factor2> n = "0123456789";
+    n.appendf("{}", 123456);
+    assert(n == "0123456789123456");
+    assert(n.capacity() == 32);
+}
+
+void test_format()
+{
+    Str s;
+    assert(s.setf("{}/{}.tmp", "folder", "file") == 15);
+    assert(s == "folder/file.tmp" && s.size() == 15);
+    assert(s.appendf("#{}", 42) == 3);
+    assert(s == "folder/file.tmp#42");
+
+    Str r = Str::ref("a reference that is long enough to hold the output");
+    r.setf("{}", 1);
+    assert(r.owned() && r == "1");
+    Str r2 = Str::ref("abc");
+    r2.appendf("{}", "def");
+    assert(r2.owned() && r2 == "abcdef");
+
+    std::string big(1000, 'x');
+    Str16 b;
+    b.setf("[{}]", big);
+    assert(b.size() == 1002 && b.view().front() == '[' && b.view().back() == ']');
+    b.appendf("{}", big);
+    assert(b.size() == 2002);
+
+    Str16 n = "hello";
+    assert(n.appendf_nogrow(" {}", "world") == 6);
+    assert(n == "hello world");
+    assert(n.appendf_nogrow("{}", "too long for it") == -1);
+    assert(n == "hello world");
+    assert(n.setf_nogrow("{}", 1234) == 4);
+    assert(n == "1234");
+    assert(n.setf_nogrow("{}", big) == -1);
+    assert(n.empty());
+}
+
+void test_format_compiled()
+{
+    // FMT_COMPILE() formats take the same paths as runtime ones
+    Str s;
+    assert(s.setf(FMT_COMPILE("{}/{}.tmp"), "folder", "file") == 15);
+    assert(s == "folder/file.tmp");
+    assert(s.appendf(FMT_COMPILE("#{:04x} {:.2f}"), 42, 1.5) == 10);
+    assert(s == "folder/file.tmp#002a 1.50");
+    assert(s.setf(FMT_COMPILE("no arguments")) == 12 && s == "no arguments");
+
+    Str r = Str::ref("a reference that is long enough to hold the output");
+    r.appendf(FMT_COMPILE("{}"), 1);
+    assert(r.owned() && r == "a reference that is long enough to hold the output1");
+
+    std::string big(1000, 'x');
+    Str16 b;
+    assert(b.setf(FMT_COMPILE("[{}]"), big) == 1002);
+    assert(b.view().front() == '[' && b.view().back() == ']' && b.c_str()[1002] == 0);
+
+    Str16 n = "hello";
+    assert(n.appendf_nogrow(FMT_COMPILE(" {}"), "world") == 6 && n == "hello world");
+    assert(n.appendf_nogrow(FMT_COMPILE("{}"), "too long for it") == -1 && n == "hello world");
+    assert(n.setf_nogrow(FMT_COMPILE("{}"), big) == -1 && n.empty());
+
+    StrHashed<Str32> h = "key";
+    size_t hash = h.hash();
+    h.appendf(FMT_COMPILE("-{}"), 7);
+    assert(h.hash() != hash && h.hash() == StrHashed<Str32>("key-7").hash());
+}
+
+void test_append_number()
+{
+    // Same text as fmt for integers, hex and doubles (shortest round-trip)
+    const int64_t ints[] = { 0, 1, -1, 9, 10, 99, 100, -100, 12345, 1000000007, INT32_MIN, INT32_MAX, INT64_MAX, INT64_MIN };
+    Str s;
+    std::string expected;
+    for (int64_t v : ints)
+    {
+        s.append_int(v);
+        s.append_uint((uint64_t)v);
+        s.append_hex((uint64_t)v);
+        s.append_hex((uint64_t)v, true);
+        s.append(" ");
+        expected += fmt::format("{}{}{:x}{:X} ", v, (uint64_t)v, (uint64_t)v, (uint64_t)v);
+    }
+    const double doubles[] = { 0.0, -0.0, 1.0, 0.1, 1.5, -2.25, 100.0, 1e20, 1e-7, 3.141592653589793, 1.0 / 3.0,
+        -1.7976931348623157e308, -2.2250738585072014e-308, 4.9406564584124654e-324 };
+    for (double v : doubles)
+    {
+        assert(s.append_double(v) > 0);
+        s.append(" ");
+        char buf[32];
+        std::to_chars_result r = std::to_chars(buf, buf + sizeof(buf), v);
+        expected += std::string_view(buf, (size_t)(r.ptr - buf));
+        expected += " ";
+        assert(strtod(std::string(buf, (size_t)(r.ptr - buf)).c_str(), NULL) == v);
+    }
+    assert(s == expected && s.c_str()[s.size()] == 0);
+
+    // Growth is exact, like append()
+    Str exact;
+    exact.set_growth(StrGrowth_Exact);
+    exact.set("a string past inline storage");
+    assert(exact.append_uint(123) == 3 && exact.capacity() == exact.size() + 1);
+
+    // _nogrow: exact fits are accepted, overflows leave the string unchanged
+    Str16 n = "0123456789";
+    assert(n.append_int_nogrow(-1234) == 5 && n == "0123456789-1234");
+    assert(n.append_uint_nogrow(1) == -1 && n.append_hex_nogrow(255) == -1 && n.append_double_nogrow(0.5) == -1);
+    assert(n == "0123456789-1234");
+    Str16 d = "x=";
+    assert(d.append_double_nogrow(0.125) == 5 && d.append_hex_nogrow(0xbeef, true) == 4 && d == "x=0.125BEEF");
+    Str64 w = "max=";
+    assert(w.append_uint_nogrow(UINT64_MAX) == 20 && w.append_int_nogrow(INT64_MIN) == 20);
+    assert(w == "max=18446744073709551615-9223372036854775808" && w.c_str()[w.size()] == 0);
+}
+
+void test_search()
+{
+    // Against std::string_view over all lengths around the SSE2/AVX2 block sizes, from every position
+    uint32_t seed = 1;
+    auto next = [&]() { seed = seed * 1664525u + 1013904223u; return seed >> 24; };
+    const StrByteSet sets[] = { StrByteSet(""), StrByteSet("b"), StrByteSet(":;/ "), StrByteSet("abcdefghij"),
+        StrByteSet("\x01\x12\x23\x34\x45\x56\x67\x78\x89\x9a"), StrByteSet("abc\xff") };
+    const char* set_bytes[] = { "", "b", ":;/ ", "abcdefghij", "\x01\x12\x23\x34\x45\x56\x67\x78\x89\x9a", "abc\xff" };
+    for (int len = 0; len < 100; len++)
+    {
+        std::string text;
+        for (int i = 0; i < len; i++)
+            text += "ab:;/ \xff\x89"[next() % 8];
+        Str s = std::string_view(text);
+        std::string_view v = text;
+        std::string needles[] = { "", "a", "ab", "b:", "ab:", "/ \xff", text.substr(len / 3, 5), text.substr(len / 2), "zz", text + "a" };
+        for (size_t pos = 0; pos <= (size_t)len + 1; pos++)
+        {
+            for (char c : { 'a', ':', '\xff', 'z' })
+            {
+                assert(s.find(c, pos) == v.find(c, pos));
+                assert(s.rfind(c, pos) == v.rfind(c, pos));
+            }
+            for (const std::string& needle : needles)
+            {
+                assert(s.find(needle, pos) == v.find(needle, pos));
+                assert(s.rfind(needle, pos) == v.rfind(needle, pos));
+            }
+            for (int k = 0; k < 6; k++)
+            {
+                std::string_view bytes(set_bytes[k]);
+                assert(s.find_first_of(sets[k], pos) == v.find_first_of(bytes, pos));
+                assert(s.find_first_not_of(sets[k], pos) == v.find_first_not_of(bytes, pos));
+            }
+        }
+        assert(s.rfind('a') == v.rfind('a') && s.rfind("ab") == v.rfind("ab"));
+    }
+    assert(!sets[4].is_nibble_exact() && sets[3].is_nibble_exact() && sets[3].Count == 10);
+
+    Str route = "/api/v2/users/42/profile";
+    assert(route.starts_with("/api/") && !route.starts_with("/apx") && route.ends_with("/profile") && !route.ends_with("x/profile"));
+    assert(route.starts_with("") && route.ends_with("") && !Str("ab").starts_with("abc"));
+    assert(route.contains("users") && route.contains('4') && !route.contains("admin") && !route.contains('#'));
+    assert(route.find_first_of("0123456789") == 6 && route.find_first_not_of("/api") == 5);
+    assert(route.find('/', 1) == 4 && route.rfind('/') == 16 && route.find("/", 100) == Str::npos);
+}
+
+void test_split()
+{
+    auto collect = [](StrSplit split)
+    {
+        std::vector<std::string> out;
+        for (Str piece : split)
+        {
+            assert(!piece.owned());
+            out.emplace_back(piece.view());
+        }
+        return out;
+    };
+    using V = std::vector<std::string>;
+    assert(collect(StrSplit("a,,b,", ',')) == (V{ "a", "", "b", "" }));
+    assert(collect(StrSplit("", ',')) == (V{ "" }));
+    assert(collect(StrSplit("", ',', StrSplitFlags_SkipEmpty)).empty());
+    assert(collect(StrSplit(",,a,,b,,", ',', StrSplitFlags_SkipEmpty)) == (V{ "a", "b" }));
+    assert(collect(StrSplit("k=v=w", '=', 0, 1)) == (V{ "k", "v=w" }));
+    assert(collect(StrSplit("k=v=w", '=', 0, 0)) == (V{ "k=v=w" }));
+    assert(collect(StrSplit("  a  b c ", ' ', StrSplitFlags_SkipEmpty, 1)) == (V{ "a", "b c " }));
+    assert(collect(StrSplit("a::b:c::", "::")) == (V{ "a", "b:c", "" }));
+    assert(collect(StrSplit("::::a::::b", "::", StrSplitFlags_SkipEmpty)) == (V{ "a", "b" }));
+    assert(collect(StrSplit("abc", "")) == (V{ "abc" }));
+    assert(collect(StrSplit("GET /index.html\tHTTP/1.1\r\n", StrByteSet(" \t\r\n"), StrSplitFlags_SkipEmpty)) == (V{ "GET", "/index.html", "HTTP/1.1" }));
+    assert(collect(StrSplit("a b\tc", StrByteSet(" \t"))) == (V{ "a", "b", "c" }));
+
+    // Pieces reference the source, long lines go through the vector kernels
+    Str line;
+    for (int i = 0; i < 100; i++)
+        line.appendf("{}key{}=value{};", i % 7 == 0 ? ";" : "", i, i);
+    int count = 0;
+    for (Str kv : line.split(';', StrSplitFlags_SkipEmpty))
+    {
+        assert(kv.c_str() >= line.c_str() && kv.c_str() + kv.size() <= line.c_str() + line.size());
+        StrSplit parts = kv.split('=');
+        StrSplit::Iterator it = parts.begin();
+        assert((*it).view() == fmt::format("key{}", count));
+        ++it;
+        assert(it.view() == fmt::format("value{}", count));
+        ++it;
+        assert(it == parts.end());
+        count++;
+    }
+    assert(count == 100);
+    Str inline_source = "x y";
+    assert(collect(inline_source.split(' ')) == (V{ "x", "y" }));
+    assert(collect(Str("a--b---c").split("--")) == (V{ "a", "b", "-c" }));
+    assert(collect(line.split(StrByteSet("=;"), StrSplitFlags_SkipEmpty, 3)).back() == line.view().substr(line.view().find("=value1;") + 1));
+}
+
+void test_copy_move()
+{
+    // Copies are deep
+    Str a = "a string long enough";
+    Str b = a;
+    assert(b == a.view() && b.c_str() != a.c_str());
+    Str16 l = "local";
+    Str16 l2 = l;
+    assert(l2 == "local" && l2.c_str() != l.c_str());
+    Str c;
+    c = l;
+    assert(c == "local" && c.owned());
+
+    // Copying a reference gives a reference
+    Str r = Str::ref("literal");
+    Str r2 = r;
+    assert(!r2.owned() && r2.c_str() == r.c_str());
+
+    // Moves steal heap buffers
+    const char* heap = a.c_str();
+    Str m = std::move(a);
+    assert(m.c_str() == heap && m == "a string long enough");
+    Str16 mh = "a string longer than the local buffer";
+    heap = mh.c_str();
+    Str16 mh2 = std::move(mh);
+    assert(mh2.c_str() == heap);
+    Str m2;
+    m2 = std::move(mh2);
+    assert(m2.c_str() == heap);
+
+    // Moving out of a local buffer copies the used bytes into our own storage
+    Str256 big_local = "in local buffer";
+    Str16 small = std::move(big_local);
+    assert(small == "in local buffer" && small.capacity() == 16);
+
+    std::vector<Str> v;
+    for (int i = 0; i < 100; i++)
+        v.push_back(Str("some string that lives on the heap"));
+    std::vector<Str16> v16(v.begin(), v.end());
+    assert(v16[99] == "some string that lives on the heap");
+    Str* p = &small;
+    *p = "Hello";
+    assert(small == "Hello");
+}
+
+struct CountingArena
+{
+    int allocs = 0;
+    int frees = 0;
+};
+
+struct CountingAllocator
+{
+    CountingArena* arena;
+    void*   allocate(size_t size)                   { arena->allocs++; return malloc(size); }
+    void    deallocate(void* ptr, size_t)           { arena->frees++; free(ptr); }
+    bool    operator==(const CountingAllocator& rhs) const { return arena == rhs.arena; }
+};
+
+void test_allocator()
+{
+    CountingArena arena, other_arena;
+    {
+        StrN<16, CountingAllocator> s(CountingAllocator{ &arena });
+        s = "short";
+        assert(arena.allocs == 0);
+        Str* base = &s;
+        base->append(" and now long enough to spill to heap");
+        assert(arena.allocs == 1 && s == "short and now long enough to spill to heap");
+        base->clear();
+        assert(arena.frees == 1);
+        base->setf("{:>40}", "heap again");
+        int allocs = arena.allocs;
+        assert(allocs >= 2 && arena.frees == allocs - 1);
+
+        // Same allocator: buffer is stolen
+        const char* heap = s.c_str();
+        StrN<16, CountingAllocator> s2(CountingAllocator{ &arena });
+        s2 = std::move(s);
+        assert(s2.c_str() == heap && arena.allocs == allocs);
+
+        // Different allocator: copied
+        StrN<0, CountingAllocator> h(CountingAllocator{ &other_arena });
+        h = std::move(s2);
+        assert(h.c_str() != heap && other_arena.allocs == 1);
+        assert(arena.frees == allocs - 1);
+
+        // Default allocator: copied
+        Str plain = std::move(h);
+        assert(plain.size() == 40 && other_arena.allocs == 1);
+    }
+    assert(arena.allocs == arena.frees);
+    assert(other_arena.allocs == other_arena.frees);
+}
+
+void test_arena()
+{
+    assert(StrArenaScope::get_current() == NULL);
+    {
+        StrArenaScope arena;
+        Str s = "a string long enough to be on the heap";
+        assert(arena.owns(s.c_str()));
+        const char* p = s.c_str();
+        for (int i = 0; i < 100; i++)
+            s.append("more");   // last allocation: grows in place
+        assert(s.c_str() == p && s.size() == 38 + 400);
+
+        Str16 local = "local";
+        assert(!arena.owns(local.c_str()));
+        {
+            StrArenaScope inner(256);
+            Str t;
+            t.setf("{:>1000}", "x"); // bigger than a chunk
+            assert(inner.owns(t.c_str()) && t.size() == 1000);
+            s.clear();
+        }
+        assert(StrArenaScope::get_current() == &arena);
+
+        // Moving out of the arena into a string with its own allocator copies
+        CountingArena counts;
+        StrN<16, CountingAllocator> c(CountingAllocator{ &counts });
+        Str a = "another arena string, long enough";
+        c = std::move(a);
+        assert(!arena.owns(c.c_str()) && counts.allocs == 1);
+    }
+    assert(StrArenaScope::get_current() == NULL);
+    Str h = "on the heap again, long enough";
+    assert(h.owned());
+}
+
+void test_pool()
+{
+    assert(StrPool::good_size(1) == 16 && StrPool::good_size(17) == 32 && StrPool::good_size(128) == 128);
+    assert(StrPool::good_size(129) == 160 && StrPool::good_size(256) == 256 && StrPool::good_size(257) == 320);
+    for (size_t size = 1; size <= STR_POOL_MAX_SIZE; size++)
+    {
+        size_t good_size = StrPool::good_size(size);
+        assert(good_size >= size && good_size - size <= size / 4 + 15);
+        assert(StrPool::good_size(good_size) == good_size);
+    }
+
+    StrN<16, StrPoolAllocator> s = "a string that doesn't fit in 16 bytes";
+    assert(s.capacity() == 48);
+    const char* p = s.c_str();
+    s.append("0123456789");  // uses the slack of the size class
+    assert(s.c_str() == p);
+    s.clear();
+    StrN<0, StrPoolAllocator> s2 = "another string that goes in the 48 bytes class";
+    assert(s2.c_str() == p); // reused from the thread cache
+
+    // Strings built on one thread and freed on another
+    std::vector<StrN<0, StrPoolAllocator>> v(1000);
+    std::thread producer([&]() { for (auto& str : v) str.setf("{:>100}", "x"); });
+    producer.join();
+    v.clear();
+    StrPool::release_cached();
+}
+
+#if STR_TELEMETRY
+void test_telemetry()
+{
+    StrTelemetry before = StrTelemetry::get_thread();
+    {
+        Str16 s = "short";                                          // local
+        s = "longer than the sixteen bytes of the local buffer";    // spill
+        s.append(" and quite a bit more after that");               // copy into a bigger heap buffer (past the pool size class too)
+    }
+    StrTelemetry after = StrTelemetry::get_thread();
+    auto delta = [&](int counter) { return after.Counters[counter] - before.Counters[counter]; };
+    assert(delta(StrTelemetryCounter_ReserveLocal) == 1);
+    assert(delta(StrTelemetryCounter_ReserveHeap) == 2);
+    assert(delta(StrTelemetryCounter_Spill) == 1);
+    assert(delta(StrTelemetry::get_spill_counter(16)) == 1);
+    assert(delta(StrTelemetryCounter_AllocCount) == 2 && delta(StrTelemetryCounter_FreeCount) == 2);
+    assert(delta(StrTelemetryCounter_AllocBytes) == delta(StrTelemetryCounter_FreeBytes));
+    assert(delta(StrTelemetryCounter_CopyCount) == 1 && delta(StrTelemetryCounter_CopyBytes) == 49);
+    assert(strcmp(StrTelemetry::get_counter_name(StrTelemetry::get_spill_counter(16)), "spill_local_16_31") == 0);
+
+    // Counters of exited threads stay in the global snapshot
+    StrTelemetry global_before = StrTelemetry::get_global();
+    std::thread([]() { Str s = "longer than inline storage"; }).join();
+    StrTelemetry global_after = StrTelemetry::get_global();
+    assert(global_after.Counters[StrTelemetryCounter_AllocCount] - global_before.Counters[StrTelemetryCounter_AllocCount] == 1);
+
+    Str256 report;
+    global_after.dump(&report);
+    assert(report.view().find("reserve_heap ") != std::string_view::npos);
+}
+#endif
+
+#if STR_PROFILE_SITES
+void test_site_profiler()
+{
+    StrSiteProfiler::reset();
+    const int site_line = __LINE__ + 3;
+    for (int i = 0; i < 100; i++)
+    {
+        Str16 s;                                    // the site being profiled
+        s.setf("{:>{}}", "x", i < 90 ? 10 : 40);    // 90% fit in 16 bytes, 10% need 41
+        if (i == 99)
+            s.append_nogrow("!");
+    }
+    StrSiteProfiler::Site* sites[STR_PROFILE_MAX_SITES];
+    int count = StrSiteProfiler::get_sites(sites, STR_PROFILE_MAX_SITES);
+    StrSiteProfiler::Site* site = NULL;
+    for (int n = 0; n < count; n++)
+        if (sites[n]->Line == site_line && sites[n]->LocalSize == 16)
+            site = sites[n];
+    assert(site != NULL);
+    assert(site->Count == 100);
+    assert(site->Spills == 10);
+    assert(site->MaxPeak == 42);
+    assert(site->PeakHistogram[StrSiteProfiler::get_bucket(11)] == 90);
+    assert(site->suggest_local_size(0.5) == 16);
+    assert(site->suggest_local_size(0.95) == 64);
+
+    Str report;
+    StrSiteProfiler::report(&report);
+    assert(report.view().find("StrN<16> count=100 spills=10.0% max_peak=42 suggest p95=StrN<64> p99=StrN<64>") != std::string_view::npos);
+}
+#endif
+
+void test_compare()
+{
+    // Kernels against a plain loop, for every length and mismatch position across the scalar/SSE2/AVX2 boundaries
+    char a[101], b[101];
+    for (int i = 0; i < 101; i++)
+        a[i] = b[i] = 'a' + i % 26;
+    for (size_t n = 0; n <= 100; n++)
+    {
+        assert(StrSimd::mismatch(a, b, n) == n);
+        assert(StrSimd::mismatch_slack(a, b, n, 100) == n);
+        assert(StrSimd::equal(a, b, n) && StrSimd::equal_slack(a, b, n, 100));
+        for (size_t pos = 0; pos < n; pos++)
+        {
+            b[pos] = (char)0xE9;
+            assert(StrSimd::mismatch(a, b, n) == pos);
+            assert(StrSimd::mismatch_slack(a, b, n, 100) == pos);
+            assert(!StrSimd::equal(a, b, n) && !StrSimd::equal_slack(a, b, n, 100));
+            assert(StrSimd::compare(a, n, b, n) < 0 && StrSimd::compare(b, n, a, n) > 0); // Bytes compare unsigned
+            b[pos] = a[pos];
+        }
+        b[n] = 'X'; // Beyond n: ignored, even when read through the slack
+        assert(StrSimd::mismatch_slack(a, b, n, 100) == n && StrSimd::equal_slack(a, b, n, 100));
+        b[n] = a[n];
+    }
+
+    // Operators against std::string_view
+    const char* words[] = { "", "a", "ab", "abc", "b", "abcdefghijklmno", "abcdefghijklmnop", "abcdefghijklmnoq", "abcdefghijklmnopqrstuvwxyz0123456789" };
+    for (const char* lhs_text : words)
+        for (const char* rhs_text : words)
+        {
+            std::string_view lhs_view = lhs_text, rhs_view = rhs_text;
+            Str64 lhs = lhs_text;                       // local buffer
+            Str rhs = rhs_text;                         // heap
+            Str rhs_ref = Str::ref(rhs_text);           // no slack
+            assert((lhs == rhs) == (lhs_view == rhs_view));
+            assert((lhs == rhs_ref) == (lhs_view == rhs_view));
+            assert((lhs == rhs_view) == (lhs_view == rhs_view));
+            assert((lhs == rhs_text) == (lhs_view == rhs_view));
+            assert((lhs <=> rhs) == (lhs_view <=> rhs_view));
+            assert((lhs <=> rhs_ref) == (lhs_view <=> rhs_view));
+            assert((lhs <=> rhs_view) == (lhs_view <=> rhs_view));
+            assert((lhs < rhs_text) == (lhs_view < rhs_view));
+        }
+}
+
+void test_hash()
+{
+    // Same contents, same hash, whatever holds them
+    const char* text = "the quick brown fox jumps over the lazy dog, twice over";
+    for (size_t n = 0; n <= strlen(text); n++)
+    {
+        std::string_view view(text, n);
+        Str heap = view;
+        Str16 local = view;
+        StrHashed<Str32> hashed = view;
+        assert(heap.hash() == StrHash()(view) && local.hash() == heap.hash());
+        assert(hashed.hash() == heap.hash() && std::hash<Str16>()(local) == heap.hash());
+        if (n > 0)
+            assert(StrHash()(std::string_view(text, n - 1)) != heap.hash());
+    }
+    assert(StrHash()("abc") == StrHash()("abc"sv) && StrSimd::hash("abc", 3, 1) != StrSimd::hash("abc", 3, 2));
+
+    // Heterogeneous lookup in the standard containers
+    std::unordered_map<Str, int, StrHash, std::equal_to<>> map;
+    map.emplace("one", 1);
+    map.emplace("two", 2);
+    assert(map.find("two"sv)->second == 2 && map.find("three"sv) == map.end());
+
+    // Cached hash is refreshed by every mutation
+    StrHashed<> h = "foo";
+    size_t foo_hash = h.hash();
+    h.append("bar");
+    assert(h.hash() == StrHash()("foobar") && h.hash() != foo_hash);
+    h.setf("{}", 42);
+    assert(h.hash() == StrHash()("42"));
+    h = "foo";
+    assert(h.hash() == foo_hash && h == StrHashed<>("foo") && h != StrHashed<>("bar"));
+
+    // Default constructed: empty, with the hash of the empty string
+    StrHashed<> e;
+    StrHashed<> e_copy = e;
+    assert(e.hash() == StrHash()("") && e_copy.hash() == e.hash() && e == e_copy && e != h);
+    e.append("foo");
+    assert(e.hash() == foo_hash && e == h);
+
+    // StrHashMap against std::unordered_map, through growth, erasure and reinsertion
+#if !STR_PROFILE_SITES
+    static_assert(sizeof(StrHashMap<int64_t>::Entry) == 64);
+#endif
+    StrHashMap<int> flat;
+    std::unordered_map<std::string, int> ref;
+    for (int i = 0; i < 5000; i++)
+    {
+        Str key;
+        if (i % 3)
+            key.setf("key{}", i);
+        else
+            key.setf("a much longer key that does not fit the local buffer {}", i);
+        assert(flat.insert(key.c_str(), i));
+        ref[key.c_str()] = i;
+    }
+    assert(!flat.insert("key1", -1) && *flat.find("key1") == 1);
+    for (int i = 0; i < 5000; i += 2)
+    {
+        Str key;
+        if (i % 3)
+            key.setf("key{}", i);
+        else
+            key.setf("a much longer key that does not fit the local buffer {}", i);
+        assert(flat.erase(key.c_str()) && !flat.erase(key.c_str()));
+        ref.erase(key.c_str());
+    }
+    flat["new"] += 7;
+    ref["new"] += 7;
+    assert(flat.size() == (int)ref.size());
+    for (auto& [key, value] : ref)
+        assert(flat.find(key) && *flat.find(key) == value);
+    int visited = 0;
+    flat.for_each([&](const Str& key, int& value) { assert(ref.at(key.c_str()) == value); visited++; });
+    assert(visited == flat.size() && !flat.contains("key0") && flat.contains("key1"));
+    flat.clear();
+    assert(flat.empty() && !flat.contains("key1"));
+}
+
+void test_intern()
+{
+    StrInternPool::Stats before = StrInternPool::get_stats();
+    Str a = Str::intern("content-type");
+    Str64 local = "content-type";
+    Str b = Str::intern(local.view());
+    assert(!a.owned() && a.c_str() == b.c_str() && a == b && a == "content-type" && a.c_str()[a.size()] == 0);
+    assert(Str::intern("content-length").c_str() != a.c_str());
+    Str c = a;                                  // copies of an interned string keep pointing into the table
+    assert(c.c_str() == a.c_str());
+    assert(Str::intern("").c_str() == Str::intern(std::string_view()).c_str());
+
+    // Threads racing to intern the same strings all get the same pointers, enough of them to grow the tables
+    const int thread_count = 8, string_count = 5000;
+    std::vector<std::vector<const char*>> results(thread_count);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++)
+        threads.emplace_back([&, t]()
+        {
+            for (int i = 0; i < string_count; i++)
+            {
+                Str16 name;
+                name.setf("metric.{}", (i * 7 + t) % string_count);
+                results[t].push_back(Str::intern(name.view()).c_str());
+            }
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+    for (int t = 0; t < thread_count; t++)
+        for (int i = 0; i < string_count; i++)
+        {
+            Str16 name;
+            name.setf("metric.{}", (i * 7 + t) % string_count);
+            Str atom = Str::intern(name.view());
+            assert(atom == name && atom.c_str() == results[t][i]);
+        }
+
+    StrInternPool::Stats after = StrInternPool::get_stats();
+    assert(after.Count - before.Count == 3 + string_count);
+    assert(after.Lookups - before.Lookups == 5 + 2 * thread_count * string_count);
+    assert(after.Hits - before.Hits == (after.Lookups - before.Lookups) - (after.Count - before.Count));
+    assert(after.get_hit_rate() > 0.5 && after.Bytes > before.Bytes);
+}
+
+void test_shared()
+{
+    Str payload;
+    payload.setf("{:>{}}", "payload", 10000);
+
+    // Copies share the buffer without allocating
+    Str a = Str::shared(payload.view());
+    assert(a.is_shared() && !a.owned() && a == payload && a.c_str()[a.size()] == 0);
+    uint64_t allocs = get_thread_alloc_count();
+    Str b = a;
+    Str128 c = a;                               // too big for the local buffer: shared too
+    std::vector<Str> fan_out(16, a);
+    assert(get_thread_alloc_count() == allocs);
+    assert(b.c_str() == a.c_str() && c.c_str() == a.c_str() && a.shared_count() == 19);
+    fan_out.clear();
+    assert(a.shared_count() == 3);
+
+    // First write detaches, the others are left alone
+    b.append("!");
+    assert(!b.is_shared() && b.owned() && b.size() == payload.size() + 1 && a == payload && a.shared_count() == 2);
+    c[0] = 'X';
+    assert(!c.is_shared() && c[0] == 'X' && c[-1] == 'd' && std::as_const(a)[0] == ' ' && a.shared_count() == 1); // non-const [] would detach a
+    Str d = a;
+    d.setf("{}", 42);
+    assert(d == "42" && a == payload);
+    d = a;
+    d.set("");
+    assert(d.empty() && a.shared_count() == 1);
+
+    // Moves steal the share, contents that fit a local buffer are copied into it
+    Str e = a;
+    Str f = std::move(e);
+    assert(f.is_shared() && !e.is_shared() && a.shared_count() == 2);
+    Str small = Str::shared("small");
+    Str16 local = small;
+    assert(!local.is_shared() && local.owned() && local == "small" && small.shared_count() == 1);
+    a.clear();
+    assert(!a.is_shared() && f == payload && f.shared_count() == 1);
+
+    // make_shared() on an existing string, then concurrent copies and releases
+    Str g = payload;
+    g.make_shared();
+    assert(g.is_shared() && g == payload);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++)
+        threads.emplace_back([&g]()
+        {
+            for (int i = 0; i < 1000; i++)
+            {
+                Str copy = g;
+                assert(copy.size() == 10000);
+            }
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+    assert(g.shared_count() == 1);
+}
+
+// Formats as its text and counts how many times it was formatted
+struct FormatCounter
+{
+    const char* Text;
+    int*        Count;
+};
+
+template<>
+struct fmt::formatter<FormatCounter> : fmt::formatter<std::string_view>
+{
+    auto format(const FormatCounter& counter, fmt::format_context& ctx) const { (*counter.Count)++; return fmt::formatter<std::string_view>::format(counter.Text, ctx); }
+};
+
+void test_builder()
+{
+    // Mix of small copies, large references and formatted pieces, against std::string
+    Str large;
+    large.setf("{:>{}}", "large", 1000);
+    StrBuilder b;
+    std::string expected;
+    for (int i = 0; i < 2000; i++)
+    {
+        b.append("row ");
+        b.appendf("{}: {:>{}}\n", i, "x", i % 50);
+        expected += "row ";
+        expected += fmt::format("{}: {:>{}}\n", i, "x", i % 50);
+        if (i % 100 == 0)
+        {
+            b += large.view();
+            expected += large.c_str();
+        }
+    }
+    b.appendf("{:>{}}", "wider than a slab", STR_BUILDER_SLAB_SIZE + 10);
+    expected += fmt::format("{:>{}}", "wider than a slab", STR_BUILDER_SLAB_SIZE + 10);
+    b.append_copy(large.view());
+    expected += large.c_str();
+    assert(b.size() == expected.size());
+    assert(b.segment_count() < 100); // Consecutive copies into a slab are a single piece
+
+    Str out = b.finish();
+    assert(out == expected && out.capacity() == expected.size() + 1);
+
+    // Output that doesn't fit the current slab continues in a new one: arguments are formatted once
+    {
+        int count = 0;
+        StrBuilder b2;
+        std::string filler(STR_BUILDER_SLAB_SIZE - 5, 'f');
+        b2.append_copy(filler);
+        b2.appendf("[{:>20}]", FormatCounter{ "straddles", &count });
+        assert(count == 1 && b2.segment_count() == 2);
+        b2.appendf("{:>{}}", FormatCounter{ "wide", &count }, STR_BUILDER_SLAB_SIZE * 2);
+        assert(count == 2);
+        assert(b2.finish() == filler + fmt::format("[{:>20}]", "straddles") + fmt::format("{:>{}}", "wide", STR_BUILDER_SLAB_SIZE * 2));
+    }
+    Str16 out_local = "replaced";
+    b.finish(&out_local);
+    assert(out_local == expected);
+
+    // Gathered write: no concatenation, same bytes
+#if STR_POSIX
+    FILE* f = tmpfile();
+    assert(b.write(fileno(f)) == (ptrdiff_t)expected.size());
+    std::string read_back(expected.size(), '\0');
+    rewind(f);
+    assert(fread(read_back.data(), 1, read_back.size(), f) == read_back.size() && read_back == expected);
+    fclose(f);
+
+    // More entries than IOV_MAX
+    std::vector<struct iovec> iov(5000);
+    for (struct iovec& entry : iov)
+    {
+        entry.iov_base = (void*)"ab";
+        entry.iov_len = 2;
+    }
+    f = tmpfile();
+    assert(StrWriteAll(fileno(f), iov.data(), (int)iov.size()) == 10000);
+    assert(lseek(fileno(f), 0, SEEK_CUR) == 10000);
+    fclose(f);
+#endif
+
+    b.clear();
+    assert(b.empty() && b.segment_count() == 0 && b.finish() == "");
+}
+
+void test_large()
+{
+    const size_t small_max = 0xFFFFFF;          // Largest size held inline, 16 MiB - 1
+    std::string big(small_max + 1, 'x');
+    big[0] = 'a';
+    big[small_max] = 'z';
+
+    // set() on each side of the boundary
+    Str a;
+    a.set(std::string_view(big.data(), small_max));
+    assert(a.size() == small_max && a.capacity() >= small_max + 1 && a[-1] == 'x' && a.c_str()[small_max] == 0);
+    a.set(big);
+    assert(a.size() == small_max + 1 && a.capacity() >= small_max + 2 && a == big && a[-1] == 'z' && a.c_str()[a.size()] == 0);
+    a.set("small");
+    assert(a == "small" && a.size() == 5);
+
+    // append() across the boundary, then keep going
+    Str b;
+    b.set(std::string_view(big.data(), small_max - 1));
+    assert(b.append("12") == 2 && b.size() == small_max + 1);
+    assert(b.view().substr(small_max - 1) == "12" && b.c_str()[b.size()] == 0);
+    for (int i = 0; i < 4; i++)
+        b.append(std::string_view(big.data(), small_max));
+    assert(b.size() == 5 * small_max + 1 && b[-1] == 'x' && b[small_max + 1] == 'a');
+    assert(b.appendf("{}", 42) == 2 && b.size() == 5 * small_max + 3 && b.view().substr(b.size() - 2) == "42");
+
+    // reserve() and shrink_to_fit() in and out of large buffers
+    Str c = "hello";
+    c.reserve(small_max);
+    assert(c.capacity() >= small_max && c == "hello");
+    c.reserve(small_max + 2);
+    assert(c.capacity() >= small_max + 2 && c == "hello");
+    c.shrink_to_fit();
+    assert(c.capacity() < small_max && c == "hello");
+    c.reserve(3 * small_max);
+    c.append(big);
+    c.shrink_to_fit();
+    assert(c.capacity() == small_max + 7 && c.size() == small_max + 6 && c.view().substr(0, 6) == "helloa");
+    Str128 d = c;
+    assert(d == c && d.capacity() > 128);
+    d.shrink_to_fit();
+    d.set("local again");
+    assert(d == "local again" && d.size() == 11);
+
+    // Copies, moves and comparisons of large strings
+    Str e = b;
+    assert(e == b && e.hash() == b.hash() && (e <=> b) == 0);
+    e[-1] = '3';
+    assert(e != b && e > b);
+    Str f = std::move(e);
+    assert(f.size() == b.size() && e.empty());
+
+    // References and shared buffers larger than 4 GiB don't touch the data
+    const size_t huge = (size_t)5 << 30;
+    Str r = Str::ref(std::string_view(big.data(), huge));
+    assert(r.size() == huge && !r.owned() && r.capacity() == huge && r.c_str() == big.data());
+    Str r2 = r;
+    assert(r2.size() == huge && r2.c_str() == big.data());
+    Str g = Str::shared(big);
+    Str h = g;
+    assert(h.is_shared() && h.size() == big.size() && h.c_str() == g.c_str() && g.shared_count() == 2);
+    h.append("!");
+    assert(!h.is_shared() && h.size() == big.size() + 1 && g.shared_count() == 1);
+}
+
+void test_inline()
+{
+    // Up to 14 characters are stored in the Str itself
+    uint64_t allocs = get_thread_alloc_count();
+    Str a = "GET";
+    Str b = "fourteen chars";
+    Str c;
+    c.set("a\0b"sv);
+    assert(get_thread_alloc_count() == allocs);
+    assert(a == "GET" && a.size() == 3 && a.owned() && a.capacity() == 15 && a.c_str()[3] == 0);
+    assert((const char*)a.c_str() >= (const char*)&a && (const char*)a.c_str() < (const char*)&a + sizeof(Str));
+    assert(b.size() == 14 && b.c_str()[14] == 0 && b[-1] == 's');
+    assert(c.view() == "a\0b"sv && c.size() == 3);
+
+    // Leaving inline storage keeps the contents, the growth policy, and comes back with shrink_to_fit()
+    a.set_growth(StrGrowth_Exact);
+    a.append(" /index.html");
+    assert(a == "GET /index.html" && a.capacity() == heap_capacity(16) && a.growth() == StrGrowth_Exact);
+    a.append(" HTTP/1.1");
+    assert(a == "GET /index.html HTTP/1.1" && a.capacity() == heap_capacity(25));
+    a.set("GET");
+    a.shrink_to_fit();
+    assert(a == "GET" && a.capacity() == 15 && a.growth() == StrGrowth_Exact);
+    a[0] = 'P';
+    a.appendf("{}", 42);
+    assert(a == "PET42" && a.capacity() == 15);
+    a.appendf("{}", 1234567890123);
+    assert(a == "PET421234567890123" && a.size() == 18);
+
+    // Copies and moves of inline strings copy the bytes, references and shared strings come inline when modified
+    Str d = b;
+    Str e = std::move(b);
+    assert(d == "fourteen chars" && e == d && d.c_str() != e.c_str());
+    assert(e.hash() == Str(std::string_view("fourteen chars and more").substr(0, 14)).hash());
+    std::vector<Str> v;
+    for (int i = 0; i < 100; i++)
+        v.push_back(Str(i % 2 ? "odd" : "an even number"));
+    assert(v[0] == "an even number" && v[99] == "odd");
+    Str r = Str::ref("ref");
+    r.append("!");
+    assert(r == "ref!" && r.owned() && r.capacity() == 15);
+    Str sh = Str::shared("shared");
+    Str sh2 = sh;
+    sh2[0] = 'S';
+    assert(sh2 == "Shared" && sh2.capacity() == 15 && sh == "shared" && sh.shared_count() == 1);
+    r = sh;
+    assert(r.is_shared() && r.size() == 6);
+    r.set_ref("x");
+    assert(!r.owned() && r == "x");
+    r.clear();
+    assert(r.empty() && !r.owned());
+
+    // Comparisons between inline and heap strings
+    Str heap = "fourteen chars plus";
+    heap.set("fourteen chars");
+    assert(heap == d && (heap <=> d) == 0 && heap.hash() == d.hash() && heap.capacity() > 15);
+    assert(Str("abc") < Str("abd") && !(Str("abc") < "a longer string that isn't inline"));
+
+    // StrN keeps using its own local buffer
+    Str16 local = "tiny";
+    Str& base = local;
+    base.append(" and then some");
+    assert(local == "tiny and then some" && local.capacity() > 16);
+    base.set("tiny");
+    assert(local.capacity() > 16);
+}
+
+void test_local_sizes()
+{
+    static_assert(Str::is_valid_local_size(255) && Str::is_valid_local_size(256) && Str::is_valid_local_size(65536));
+    static_assert(!Str::is_valid_local_size(300) && !Str::is_valid_local_size(65536 + 256));
+#if !STR_PROFILE_SITES
+    static_assert(sizeof(Str) == 16);
+#endif
+
+    // Local buffers of 256 bytes and more are used, not truncated
+    uint64_t allocs = get_thread_alloc_count();
+    Str256 a;
+    a.setf("{:>255}", "x");
+    StrN<4096> b;
+    b.setf("{:>4095}", "y");
+    auto c = std::make_unique<StrN<65536>>();
+    c->setf("{:>65535}", "z");
+    assert(get_thread_alloc_count() == allocs);
+    assert(a.size() == 255 && a.capacity() == 256 && a[-1] == 'x' && (const char*)a.c_str() == (const char*)&a + sizeof(Str));
+    assert(b.size() == 4095 && b.capacity() == 4096 && b[-1] == 'y');
+    assert(c->size() == 65535 && c->capacity() == 65536 && (*c)[-1] == 'z');
+
+    // Spill to the heap, and back to the local buffer after clear()
+    b.append("!");
+    assert(b.size() == 4096 && b.capacity() > 4096 && b[-1] == '!');
+    b.clear();
+    assert(b.capacity() == 4096);
+    b = a;
+    assert(b == a && b.capacity() == 4096);
+
+    // The allocator slot is found after a large local buffer
+    CountingArena arena;
+    {
+        auto d = std::make_unique<StrN<16384, CountingAllocator>>(CountingAllocator{ &arena });
+        d->setf("{:>16383}", "w");
+        assert(arena.allocs == 0 && d->capacity() == 16384);
+        d->append("!");
+        assert(arena.allocs == 1 && d->size() == 16384 && d->get_allocator().arena == &arena);
+    }
+    assert(arena.frees == 1);
+}
+
+// Tables built during constant evaluation, without dynamic initializers
+constinit Str g_constant_ref = Str::ref("constant reference");
+constinit Str32 g_constant_names[] = { "alpha", "beta", "" };
+constexpr Str g_constexpr_ref = Str::ref("compile time");
+constexpr Str16 g_constexpr_local = "local";
+static_assert(g_constexpr_ref.size() == 12 && g_constexpr_ref.view() == "compile time" && !g_constexpr_ref.owned());
+static_assert(g_constexpr_local.view() == "local" && g_constexpr_local.capacity() == 16 && g_constexpr_local.owned());
+static_assert(Str::ref("abc").size() == 3 && Str().empty() && Str256().capacity() == 256);
+
+void test_constant_init()
+{
+    assert(g_constant_ref == "constant reference" && !g_constant_ref.owned());
+    assert(g_constant_names[0] == "alpha" && g_constant_names[1] == "beta" && g_constant_names[2].empty());
+    assert(g_constexpr_local.c_str()[5] == 0 && g_constexpr_local == Str("local"));
+
+    // Constant-initialized strings are regular strings afterwards
+    g_constant_names[0].append(" and omega");
+    assert(g_constant_names[0] == "alpha and omega" && g_constant_names[0].capacity() == 32);
+    g_constant_names[1].append(" is longer than the local buffer of 32 bytes");
+    assert(g_constant_names[1].size() == 48 && g_constant_names[1].capacity() > 32);
+    g_constant_names[1].clear();
+    assert(g_constant_names[1].capacity() == 32);
+    Str copy = g_constant_ref;
+    assert(copy.c_str() == g_constant_ref.c_str());
+}
+
+#if STR_POSIX
+void test_map_file()
+{
+    // Mapped files are read-only shared buffers, terminated even when the size is a multiple of the page size
+    const char* path = "/tmp/str_test_map_file.txt";
+    for (size_t size : { (size_t)1, (size_t)100, (size_t)sysconf(_SC_PAGESIZE), (size_t)3 * 1024 * 1024 })
+    {
+        std::string contents(size, 'x');
+        contents[0] = 'a';
+        contents[size - 1] = 'z';
+        FILE* f = fopen(path, "wb");
+        fwrite(contents.data(), 1, size, f);
+        fclose(f);
+
+        Str a = Str::map_file(path);
+        assert(a.is_mapped() && a.is_shared() && !a.owned() && a.size() == size && a == contents && a.c_str()[size] == 0);
+        Str b = a;
+        assert(b.is_mapped() && b.c_str() == a.c_str() && a.shared_count() == 2);
+        b.append("!");
+        assert(!b.is_mapped() && b.owned() && b.size() == size + 1 && a == contents && a.shared_count() == 1);
+        Str256 c = a;
+        assert(c == a);
+        a.clear();
+        assert(!a.is_mapped() && c == contents);
+    }
+
+    // Empty files, missing files, set_mapped_file() over an existing string
+    fclose(fopen(path, "wb"));
+    Str empty = Str::map_file(path);
+    assert(empty.empty() && !empty.is_mapped());
+    unlink(path);
+    errno = 0;
+    Str missing = Str::map_file(path);
+    assert(missing.empty() && errno == ENOENT);
+    Str16 s = "unchanged";
+    assert(!s.set_mapped_file(path) && s == "unchanged");
+
+    // Pipes are read instead
+    int fds[2];
+    assert(pipe(fds) == 0);
+    std::string payload(100000, 'p');
+    std::thread writer([&]() { assert(write(fds[1], payload.data(), payload.size()) == (ssize_t)payload.size()); close(fds[1]); });
+    char pipe_path[64];
+    snprintf(pipe_path, sizeof(pipe_path), "/dev/fd/%d", fds[0]);
+    assert(s.set_mapped_file(pipe_path));
+    writer.join();
+    close(fds[0]);
+    assert(!s.is_mapped() && s.owned() && s == payload && s.c_str()[s.size()] == 0);
+
+    // Read into a string with its own allocator: copied into a buffer from that allocator
+    CountingArena arena;
+    {
+        StrN<0, CountingAllocator> h(CountingAllocator{ &arena });
+        assert(pipe(fds) == 0);
+        std::thread writer2([&]() { assert(write(fds[1], payload.data(), payload.size()) == (ssize_t)payload.size()); close(fds[1]); });
+        snprintf(pipe_path, sizeof(pipe_path), "/dev/fd/%d", fds[0]);
+        assert(h.set_mapped_file(pipe_path));
+        writer2.join();
+        close(fds[0]);
+        assert(h == payload && arena.allocs == 1);
+    }
+    assert(arena.frees == 1);
+}
+
+void test_iovec()
+{
+    // Alternating small (coalesced) and large (referenced) pieces: several batches, scratch buffer overflows
+    std::vector<Str> pieces;
+    std::string expected;
+    for (int i = 0; i < 3000; i++)
+    {
+        Str& piece = pieces.emplace_back();
+        if (i % 3 == 2)
+            piece.setf("{:>{}}", i, 100 + i % 50);
+        else
+            piece.setf("{:>{}}|", i, i % 60);
+        expected += piece.c_str();
+    }
+    FILE* f = tmpfile();
+    StrIoVec out(fileno(f));
+    for (const Str& piece : pieces)
+        out.add(piece);
+    out.add("");
+    assert(out.flush() == (ptrdiff_t)expected.size() && out.written() == (ptrdiff_t)expected.size());
+    std::string read_back(expected.size(), '\0');
+    rewind(f);
+    assert(fread(read_back.data(), 1, read_back.size(), f) == read_back.size() && read_back == expected);
+    fclose(f);
+
+    // Str::write_all() over pointers
+    std::vector<const Str*> ptrs;
+    for (const Str& piece : pieces)
+        ptrs.push_back(&piece);
+    f = tmpfile();
+    assert(Str::write_all(fileno(f), ptrs) == (ptrdiff_t)expected.size());
+    rewind(f);
+    assert(fread(read_back.data(), 1, read_back.size(), f) == read_back.size() && read_back == expected);
+    fclose(f);
+    assert(Str::write_all(1, {}) == 0);
+
+    // Errors stick
+    StrIoVec bad(-1);
+    bad.add(pieces[2]);
+    errno = 0;
+    assert(bad.flush() == -1 && errno == EBADF);
+    bad.add(pieces[0]);
+    assert(bad.flush() == -1);
+}
+#endif
+
+void test_append_buffer()
+{
+    // Appends that don't fit fail like append_nogrow() and leave no trace, flush() empties the buffer
+    StrAppendBuffer small(10);
+    assert(small.append("hello") == 5 && small.append("12345") == 5 && small.append("x") == -1);
+    std::string flushed;
+    assert(small.flush([&](std::string_view s) { flushed = s; }) == 10 && flushed == "hello12345");
+    assert(small.append("hello") == 5 && small.append("world!") == -1 && small.append("123") == 3);
+    assert(small.flush([&](std::string_view s) { flushed = s; }) == 8 && flushed == "hello123");
+    assert(small.append("again") == 5);
+    assert(small.flush([&](std::string_view s) { flushed = s; }) == 5 && flushed == "again");
+    assert(small.flush([&](std::string_view s) { flushed = s; }) == 0 && flushed == "");
+    assert(small.append("too long for it") == -1);
+
+    // Failed appends to a full buffer, more than enough to have overflowed the reserved size field
+    StrAppendBuffer full(1 << 20);
+    std::string chunk(1 << 20, 'A');
+    assert(full.append(chunk) == (ptrdiff_t)chunk.size());
+    for (int i = 0; i < (1 << 24); i++)
+        assert(full.append(chunk) == -1);
+    assert(full.append("B") == -1);
+    assert(full.flush([&](std::string_view s) { flushed = s; }) == chunk.size() && flushed == chunk);
+
+    // Producers racing with a flusher: every accepted line comes out exactly once and whole
+    StrAppendBuffer log(4096);
+    const int thread_count = 4;
+    const int lines_per_thread = 20000;
+    std::atomic<int> accepted = 0;
+    std::atomic<bool> done = false;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++)
+        threads.emplace_back([&, t]()
+        {
+            Str32 line;
+            for (int i = 0; i < lines_per_thread; i++)
+            {
+                line.setf("t{}:{}\n", t, i);
+                while (log.append(line.view()) < 0)
+                    std::this_thread::yield();
+                accepted++;
+            }
+        });
+    std::string out;
+    std::thread flusher([&]()
+    {
+        while (!done)
+            log.flush([&](std::string_view s) { out += s; });
+    });
+    for (std::thread& thread : threads)
+        thread.join();
+    done = true;
+    flusher.join();
+    log.flush([&](std::string_view s) { out += s; });
+    log.flush([&](std::string_view s) { out += s; });
+
+    std::vector<int> seen(thread_count, 0);
+    int lines = 0;
+    for (size_t pos = 0; pos < out.size(); )
+    {
+        size_t end = out.find('\n', pos);
+        assert(end != std::string::npos);
+        int t = 0, i = 0;
+        assert(sscanf(out.c_str() + pos, "t%d:%d", &t, &i) == 2 && t >= 0 && t < thread_count);
+        assert(i < lines_per_thread);
+        seen[t]++;
+        lines++;
+        pos = end + 1;
+    }
+    assert(lines == accepted && lines == thread_count * lines_per_thread);
+    for (int t = 0; t < thread_count; t++)
+        assert(seen[t] == lines_per_thread);
+}
+
 int main() {
     test_pointer();
     test_append_nogrow();
     test_append();
     test_shrink();
+    test_growth();
+    test_format();
+    test_format_compiled();
+    test_append_number();
+    test_search();
+    test_split();
+    test_copy_move();
+    test_allocator();
+    test_arena();
+    test_pool();
+#if STR_TELEMETRY
+    test_telemetry();
+#endif
+#if STR_PROFILE_SITES
+    test_site_profiler();
+#endif
+    test_compare();
+    test_hash();
+    test_intern();
+    test_shared();
+    test_builder();
+    test_large();
+#if STR_SSO
+    test_inline();
+#endif
+    test_local_sizes();
+    test_constant_init();
+    test_append_buffer();
+#if STR_POSIX
+    test_map_file();
+    test_iovec();
+#endif
 }
@@ -0,0 +1,4 @@
+// Runs the tests of test.cpp with allocation telemetry and per-site profiling compiled in (changes the layout of Str)
+#define STR_TELEMETRY 1
+#define STR_PROFILE_SITES 1
+#include "test.cpp"